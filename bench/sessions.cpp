@@ -0,0 +1,99 @@
+// Stress benchmark for concurrent compilation: N threads each compile a
+// script in a session of one shared Engine, then the same scripts are
+// compiled one after another on a single thread for comparison.
+//
+//   fermat-bench-sessions [threads] [functions per script]
+
+#include "Engine.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Shared by every session, compiled once up front
+static const char *Library = R"(
+def square(x) x * x
+def poly(x) square(x) + 3 * x + 1
+def clamp(x lo hi) if x < lo then lo else if x > hi then hi else x
+)";
+
+// Script Id: a chain of functions calling the library and each other
+static std::string makeScript(unsigned Id, unsigned NumFunctions) {
+  std::string S = "def f0(x) poly(x) + " + std::to_string(Id) + "\n";
+  for (unsigned i = 1; i < NumFunctions; ++i) {
+    std::string Prev = "f" + std::to_string(i - 1);
+    S += "def f" + std::to_string(i) + "(x)\n"
+         "  let y = clamp(" + Prev + "(x), 0, 1000000);\n"
+         "  if y < " + std::to_string(i) + " then y + square(x) else y - " +
+         std::to_string(i) + " + " + Prev + "(x) * 0\n";
+  }
+  return S;
+}
+
+// What f<NumFunctions-1>(X) of script Id evaluates to
+static double expected(unsigned Id, unsigned NumFunctions, double X) {
+  auto Clamp = [](double V) { return V < 0 ? 0 : V > 1000000 ? 1000000 : V; };
+  double F = X * X + 3 * X + 1 + Id;
+  for (unsigned i = 1; i < NumFunctions; ++i) {
+    double Y = Clamp(F);
+    F = Y < i ? Y + X * X : Y - i + F * 0;
+  }
+  return F;
+}
+
+// Compile script Id in a new session and check its result
+static bool runScript(Engine &Base, unsigned Id, unsigned NumFunctions) {
+  auto Session = Base.createSession();
+  if (!Session->compile(makeScript(Id, NumFunctions)))
+    return false;
+  std::string Last = "f" + std::to_string(NumFunctions - 1);
+  auto *F = Session->getFunction<double(double)>(Last);
+  return F && F(2.0) == expected(Id, NumFunctions, 2.0);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       Start)
+      .count();
+}
+
+int main(int argc, char *argv[]) {
+  unsigned NumThreads =
+      argc > 1 ? (unsigned)atoi(argv[1]) : std::thread::hardware_concurrency();
+  unsigned NumFunctions = argc > 2 ? (unsigned)atoi(argv[2]) : 200;
+  NumThreads = NumThreads ? NumThreads : 1;
+  NumFunctions = NumFunctions ? NumFunctions : 1;
+
+  Engine Base;
+  if (!Base.compile(Library))
+    return 1;
+  Base.precompile();
+
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<std::thread> Threads;
+  std::vector<char> Ok(NumThreads);
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Threads.emplace_back(
+        [&, i] { Ok[i] = runScript(Base, i, NumFunctions); });
+  for (std::thread &T : Threads)
+    T.join();
+  double Parallel = secondsSince(Start);
+
+  Start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Ok[i] &= runScript(Base, i, NumFunctions);
+  double Serial = secondsSince(Start);
+
+  unsigned Failed = 0;
+  for (char Passed : Ok)
+    Failed += !Passed;
+  printf("%u scripts of %u functions\n", NumThreads, NumFunctions);
+  printf("  %u threads: %.3f s\n", NumThreads, Parallel);
+  printf("  1 thread:  %.3f s\n", Serial);
+  printf("  speedup:   %.2fx\n", Serial / Parallel);
+  if (Failed)
+    printf("  %u scripts gave wrong results\n", Failed);
+  return Failed ? 1 : 0;
+}
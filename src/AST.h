@@ -1,10 +1,18 @@
 #ifndef AST_H
 #define AST_H
 
+#include "Symbol.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
 #include "llvm/IR/Value.h"
-#include <map>
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 using namespace llvm;
@@ -13,18 +21,44 @@ using namespace llvm;
 // Type System
 //===----------------------------------------------------------------------===//
 
-enum class SpyType { Unknown, Int, Float, String, Bool, Struct, Void };
+// Vec2, Vec4 and Vec8 are SIMD vectors of doubles
+enum class SpyType {
+  Unknown,
+  Int,
+  Float,
+  String,
+  Bool,
+  Struct,
+  Void,
+  Vec2,
+  Vec4,
+  Vec8
+};
 
 // Type information for variables and functions
 struct TypeInfo {
   SpyType BaseType = SpyType::Unknown;
-  std::string StructName; // For struct types
+  Symbol StructName; // For struct types
 
   TypeInfo() = default;
   TypeInfo(SpyType t) : BaseType(t) {}
-  TypeInfo(const std::string &structName)
+  TypeInfo(Symbol structName)
       : BaseType(SpyType::Struct), StructName(structName) {}
 
+  // Number of lanes of a vector type, 0 for anything else
+  unsigned vectorLanes() const {
+    switch (BaseType) {
+    case SpyType::Vec2:
+      return 2;
+    case SpyType::Vec4:
+      return 4;
+    case SpyType::Vec8:
+      return 8;
+    default:
+      return 0;
+    }
+  }
+
   bool operator==(const TypeInfo &other) const {
     return BaseType == other.BaseType && StructName == other.StructName;
   }
@@ -41,8 +75,14 @@ struct TypeInfo {
       return "bool";
     case SpyType::Void:
       return "void";
+    case SpyType::Vec2:
+      return "vec2";
+    case SpyType::Vec4:
+      return "vec4";
+    case SpyType::Vec8:
+      return "vec8";
     case SpyType::Struct:
-      return StructName;
+      return StructName.str().str();
     default:
       return "unknown";
     }
@@ -51,18 +91,25 @@ struct TypeInfo {
 
 // Struct field definition
 struct StructField {
-  std::string Name;
+  Symbol Name;
   TypeInfo Type;
 };
 
 // Struct type definition
 struct StructDef {
-  std::string Name;
+  Symbol Name;
   std::vector<StructField> Fields;
+  Symbol DropFn; // Called on owned values at scope exit, if set
 };
 
 // Global struct registry
-extern std::map<std::string, StructDef> StructTypes;
+extern thread_local DenseMap<Symbol, StructDef> StructTypes;
+
+// Functions are told apart by arity: add(x) is add$1, add(x, y) add$2
+inline Symbol mangledName(Symbol Name, size_t NumArgs) {
+  SmallString<32> Buffer;
+  return Symbol((Name.str() + "$" + Twine(NumArgs)).toStringRef(Buffer));
+}
 
 //===----------------------------------------------------------------------===//
 // Ownership Types
@@ -72,15 +119,54 @@ enum class Mutability { Immutable, Mutable };
 
 enum class Ownership { Owned, Borrowed, BorrowedMut };
 
+//===----------------------------------------------------------------------===//
+// AST Memory
+//===----------------------------------------------------------------------===//
+
+// Storage for expression nodes. Nodes are bump-allocated and never destroyed
+// one by one: reset() releases all of them at once. Child lists are arrays
+// in the arena; names are symbols.
+class ASTArena {
+  BumpPtrAllocator Alloc;
+
+public:
+  template <typename T, typename... ArgTs> T *make(ArgTs &&...Args) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena nodes are never destroyed");
+    return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+  }
+
+  // Copy of Items that lives as long as the arena
+  template <typename T> ArrayRef<T> copy(ArrayRef<T> Items) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena arrays are never destroyed");
+    T *Mem = Alloc.Allocate<T>(Items.size());
+    std::uninitialized_copy(Items.begin(), Items.end(), Mem);
+    return ArrayRef<T>(Mem, Items.size());
+  }
+
+  StringRef copy(StringRef Str) { return StringSaver(Alloc).save(Str); }
+
+  void reset() { Alloc.Reset(); }
+};
+
 //===----------------------------------------------------------------------===//
 // Expression AST Nodes
 //===----------------------------------------------------------------------===//
 
+// Expression nodes live in an ASTArena (see Parser.h) and point to their
+// children there.
 class ExprAST {
+protected:
+  ~ExprAST() = default;
+
 public:
-  virtual ~ExprAST() = default;
   virtual Value *codegen() = 0;
   virtual TypeInfo getType() const { return TypeInfo(SpyType::Float); }
+
+  // Called on an expression whose value leaves the enclosing function.
+  // Variables in tail position give up ownership instead of being dropped.
+  virtual void markReturned() {}
 };
 
 class NumberExprAST : public ExprAST {
@@ -97,117 +183,130 @@ public:
 };
 
 class StringExprAST : public ExprAST {
-  std::string Val;
+  StringRef Val;
 
 public:
-  StringExprAST(const std::string &Val) : Val(Val) {}
+  StringExprAST(StringRef Val) : Val(Val) {}
   Value *codegen() override;
-  const std::string &getValue() const { return Val; }
+  StringRef getValue() const { return Val; }
   TypeInfo getType() const override { return TypeInfo(SpyType::String); }
 };
 
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  Symbol Name;
+  bool IsMove = false; // Reading the value transfers ownership
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(Symbol Name) : Name(Name) {}
   Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  Symbol getName() const { return Name; }
+  void setIsMove() { IsMove = true; }
+  void markReturned() override { IsMove = true; }
 };
 
 class UnaryExprAST : public ExprAST {
   int Opcode;
-  std::unique_ptr<ExprAST> Operand;
+  ExprAST *Operand;
 
 public:
-  UnaryExprAST(int Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
+  UnaryExprAST(int Opcode, ExprAST *Operand)
+      : Opcode(Opcode), Operand(Operand) {}
   Value *codegen() override;
 };
 
 class BinaryExprAST : public ExprAST {
   int Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(int Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryExprAST(int Op, ExprAST *LHS, ExprAST *RHS)
+      : Op(Op), LHS(LHS), RHS(RHS) {}
   Value *codegen() override;
+  void markReturned() override {
+    if (Op == ';')
+      RHS->markReturned();
+  }
 };
 
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  Symbol Callee;
+  Symbol MangledCallee; // Callee by the name its definition is found under
+  ArrayRef<ExprAST *> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+  CallExprAST(Symbol Callee, ArrayRef<ExprAST *> Args)
+      : Callee(Callee), MangledCallee(mangledName(Callee, Args.size())),
+        Args(Args) {}
   Value *codegen() override;
-  // Construct mangled name for lookups
-  std::string getMangledName() const {
-    return Callee + "$" + std::to_string(Args.size());
-  }
+  Symbol getMangledName() const { return MangledCallee; }
 };
 
 class LetExprAST : public ExprAST {
-  std::string Name;
+  Symbol Name;
   Mutability Mut;
-  TypeInfo DeclaredType;
-  std::unique_ptr<ExprAST> Init;
-  std::unique_ptr<ExprAST> Body;
+  ExprAST *Init;
+  ExprAST *Body;
+  Symbol DropFn; // Set when the binding owns a resource
 
 public:
-  LetExprAST(const std::string &Name, Mutability Mut, TypeInfo Type,
-             std::unique_ptr<ExprAST> Init, std::unique_ptr<ExprAST> Body)
-      : Name(Name), Mut(Mut), DeclaredType(Type), Init(std::move(Init)),
-        Body(std::move(Body)) {}
+  LetExprAST(Symbol Name, Mutability Mut, ExprAST *Init, ExprAST *Body)
+      : Name(Name), Mut(Mut), Init(Init), Body(Body) {}
   Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  Symbol getName() const { return Name; }
   bool isMutable() const { return Mut == Mutability::Mutable; }
+  void setDropFunction(Symbol Fn) { DropFn = Fn; }
+  void markReturned() override {
+    if (Body)
+      Body->markReturned();
+    else
+      DropFn = Symbol(); // The bound value itself is the result
+  }
 };
 
 class AssignExprAST : public ExprAST {
-  std::string Name;
-  std::unique_ptr<ExprAST> Value_;
+  Symbol Name;
+  ExprAST *Value_;
 
 public:
-  AssignExprAST(const std::string &Name, std::unique_ptr<ExprAST> Value)
-      : Name(Name), Value_(std::move(Value)) {}
+  AssignExprAST(Symbol Name, ExprAST *Value) : Name(Name), Value_(Value) {}
   Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  Symbol getName() const { return Name; }
 };
 
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : Cond(Cond), Then(Then), Else(Else) {}
   Value *codegen() override;
+  void markReturned() override {
+    Then->markReturned();
+    if (Else)
+      Else->markReturned();
+  }
 };
 
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  Symbol VarName;
+  ExprAST *Start, *End, *Step, *Body;
+  bool IsParallel; // parallel for: iterations run on the thread pool
+
+  Value *codegenParallel();
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+  ForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body, bool IsParallel = false)
+      : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body),
+        IsParallel(IsParallel) {}
   Value *codegen() override;
 };
 
 class WhileExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Body;
+  ExprAST *Cond, *Body;
 
 public:
-  WhileExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Body)
-      : Cond(std::move(Cond)), Body(std::move(Body)) {}
+  WhileExprAST(ExprAST *Cond, ExprAST *Body) : Cond(Cond), Body(Body) {}
   Value *codegen() override;
 };
 
@@ -223,28 +322,82 @@ public:
   Value *codegen() override;
 };
 
+// Region block: with arena do ... end
+// Collections created in the body are freed together when the block exits.
+class ArenaExprAST : public ExprAST {
+  ExprAST *Body;
+
+public:
+  ArenaExprAST(ExprAST *Body) : Body(Body) {}
+  Value *codegen() override;
+  void markReturned() override { Body->markReturned(); }
+};
+
+// Reduction: reduce(op, i = start, end[, step]) expr
+// Combines the values of expr over the iterations of the loop header with
+// an associative operator, in parallel where that gives the same result.
+enum class ReduceOp { Add, Mul, Min, Max };
+
+class ReduceExprAST : public ExprAST {
+  ReduceOp Op;
+  Symbol VarName;
+  ExprAST *Start, *End, *Step, *Body;
+
+public:
+  ReduceExprAST(ReduceOp Op, Symbol VarName, ExprAST *Start, ExprAST *End,
+                ExprAST *Step, ExprAST *Body)
+      : Op(Op), VarName(VarName), Start(Start), End(End), Step(Step),
+        Body(Body) {}
+  Value *codegen() override;
+};
+
+// Task spawn: spawn expr
+// Evaluates expr on the thread pool. The value is a future handle whose
+// result is read with join(f).
+class SpawnExprAST : public ExprAST {
+  ExprAST *Body;
+
+public:
+  SpawnExprAST(ExprAST *Body) : Body(Body) {}
+  Value *codegen() override;
+};
+
+// Await: await expr
+// Waits for the task expr evaluates to and gives its value. In an async
+// function this suspends the coroutine; elsewhere it runs the event loop.
+class AwaitExprAST : public ExprAST {
+  ExprAST *Task;
+
+public:
+  AwaitExprAST(ExprAST *Task) : Task(Task) {}
+  Value *codegen() override;
+};
+
 // Struct instantiation: Point{x: 1.0, y: 2.0}
+struct FieldInit {
+  Symbol Name;
+  ExprAST *Value;
+};
+
 class StructExprAST : public ExprAST {
-  std::string StructName;
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Fields;
+  Symbol StructName;
+  ArrayRef<FieldInit> Fields;
 
 public:
-  StructExprAST(
-      const std::string &Name,
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Fields)
-      : StructName(Name), Fields(std::move(Fields)) {}
+  StructExprAST(Symbol Name, ArrayRef<FieldInit> Fields)
+      : StructName(Name), Fields(Fields) {}
   Value *codegen() override;
   TypeInfo getType() const override { return TypeInfo(StructName); }
 };
 
 // Field access: obj.field
 class MemberExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Object;
-  std::string Member;
+  ExprAST *Object;
+  Symbol Member;
 
 public:
-  MemberExprAST(std::unique_ptr<ExprAST> Object, const std::string &Member)
-      : Object(std::move(Object)), Member(Member) {}
+  MemberExprAST(ExprAST *Object, Symbol Member)
+      : Object(Object), Member(Member) {}
   Value *codegen() override;
 };
 
@@ -253,76 +406,83 @@ public:
 //===----------------------------------------------------------------------===//
 
 struct TypedArg {
-  std::string Name;
+  Symbol Name;
   TypeInfo Type;
 };
 
 class PrototypeAST {
-  std::string Name;
+  Symbol Name;
   std::vector<TypedArg> Args;
   TypeInfo ReturnType;
 
-  std::string MangledName;
+  Symbol MangledName;
   bool IsExtern = false;
+  bool IsAsync = false;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<TypedArg> Args,
+  PrototypeAST(Symbol Name, std::vector<TypedArg> Args,
                TypeInfo RetType = TypeInfo(SpyType::Float))
-      : Name(Name), Args(std::move(Args)), ReturnType(RetType) {
-    // Basic arity-based mangling: name$arity
-    // e.g., add(x) -> add$1, add(x, y) -> add$2
-    MangledName = Name + "$" + std::to_string(this->Args.size());
-  }
+      : Name(Name), Args(std::move(Args)), ReturnType(RetType),
+        MangledName(mangledName(Name, this->Args.size())) {}
 
   void setIsExtern(bool isExtern) { IsExtern = isExtern; }
 
-  const std::string &getName() const {
+  // Async functions return a Task for their result (see lib/async.frmt)
+  void setIsAsync() {
+    IsAsync = true;
+    ReturnType = TypeInfo(Symbol("Task"));
+  }
+  bool isAsync() const { return IsAsync; }
+
+  Symbol getName() const {
     return IsExtern ? Name : MangledName;
   } // Use mangled name as the primary name
-  const std::string &getOriginalName() const { return Name; }
+  Symbol getOriginalName() const { return Name; }
   const std::vector<TypedArg> &getArgs() const { return Args; }
   const TypeInfo &getReturnType() const { return ReturnType; }
   Function *codegen();
 };
 
+// Top-level declarations are heap-allocated: their prototypes outlive the
+// arena their bodies are in.
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  ExprAST *Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
   Function *codegen();
 };
 
 // Struct type definition AST
 // Static global variable AST
 class GlobalVarAST {
-  std::string Name;
+  Symbol Name;
   TypeInfo Type;
-  std::unique_ptr<ExprAST> Init;
+  ExprAST *Init;
 
 public:
-  GlobalVarAST(const std::string &Name, TypeInfo Type,
-               std::unique_ptr<ExprAST> Init)
-      : Name(Name), Type(Type), Init(std::move(Init)) {}
+  GlobalVarAST(Symbol Name, TypeInfo Type, ExprAST *Init)
+      : Name(Name), Type(Type), Init(Init) {}
   void codegen();
-  const std::string &getName() const { return Name; }
+  Symbol getName() const { return Name; }
 };
 
 // Struct type definition AST
 class StructDefAST {
-  std::string Name;
+  Symbol Name;
   std::vector<StructField> Fields;
   bool IsAbstract;
+  Symbol DropFn;
 
 public:
-  StructDefAST(const std::string &Name, std::vector<StructField> Fields,
-               bool IsAbstract = false)
-      : Name(Name), Fields(std::move(Fields)), IsAbstract(IsAbstract) {}
+  StructDefAST(Symbol Name, std::vector<StructField> Fields,
+               bool IsAbstract = false, Symbol DropFn = Symbol())
+      : Name(Name), Fields(std::move(Fields)), IsAbstract(IsAbstract),
+        DropFn(DropFn) {}
   void codegen();
-  const std::string &getName() const { return Name; }
+  Symbol getName() const { return Name; }
   bool isAbstract() const { return IsAbstract; }
 };
 
@@ -1,165 +1,248 @@
 #include "BorrowCheck.h"
-#include <sstream>
+#include <algorithm>
 
 // Global borrow checker instance
-BorrowChecker TheBorrowChecker;
+thread_local BorrowChecker TheBorrowChecker;
+
+VariableState *BorrowChecker::find(Symbol Name) {
+  auto It = Visible.find(Name);
+  return It == Visible.end() ? nullptr : &Bindings[It->second].State;
+}
+
+const VariableState *BorrowChecker::find(Symbol Name) const {
+  auto It = Visible.find(Name);
+  return It == Visible.end() ? nullptr : &Bindings[It->second].State;
+}
 
 void BorrowChecker::exitScope() {
-  // Remove all variables declared in the current scope
-  auto it = Variables.begin();
-  while (it != Variables.end()) {
-    if (it->second.ScopeLevel == CurrentScope) {
-      it = Variables.erase(it);
-    } else {
-      ++it;
+  Scope S = Scopes.back();
+  Scopes.pop_back();
+  for (size_t i = Bindings.size(); i > S.FirstBinding; --i) {
+    const Binding &B = Bindings[i - 1];
+    if (B.Shadowed >= 0)
+      Visible[B.Name] = B.Shadowed;
+    else
+      Visible.erase(B.Name);
+  }
+  Bindings.resize(S.FirstBinding);
+
+  // Moves of the popped bindings are not for a branch to undo or redo
+  size_t Kept = std::min(S.FirstMove, Moves.size());
+  for (size_t i = Kept; i < Moves.size(); ++i)
+    if (Moves[i] < S.FirstBinding)
+      Moves[Kept++] = Moves[i];
+  Moves.resize(Kept);
+}
+
+void BorrowChecker::nextBranch() {
+  Branch &B = Branches.back();
+  for (size_t i = B.FirstMove; i < Moves.size(); ++i) {
+    Bindings[Moves[i]].State.IsMoved = false;
+    B.Moved.push_back(Moves[i]);
+  }
+  Moves.resize(B.FirstMove);
+}
+
+void BorrowChecker::endBranch() {
+  // The last branch's moves still stand; add those of the others
+  for (unsigned Index : Branches.back().Moved) {
+    VariableState &State = Bindings[Index].State;
+    if (!State.IsMoved) {
+      State.IsMoved = true;
+      Moves.push_back(Index);
     }
   }
-  CurrentScope--;
+  Branches.pop_back();
+  if (Branches.empty())
+    Moves.clear();
 }
 
-void BorrowChecker::declareVariable(const std::string &Name, bool IsMutable) {
+void BorrowChecker::unwindTo(Depth D) {
+  Branches.resize(std::min(Branches.size(), D.NumBranches));
+  if (Branches.empty())
+    Moves.clear();
+  while (Scopes.size() > D.NumScopes)
+    exitScope();
+  while (!ParallelScopes.empty() &&
+         ParallelScopes.back() >= (int)Scopes.size())
+    ParallelScopes.pop_back();
+  while (!LoopScopes.empty() && LoopScopes.back() >= (int)Scopes.size())
+    LoopScopes.pop_back();
+}
+
+void BorrowChecker::declareVariable(Symbol Name, bool IsMutable,
+                                    Symbol ResourceType) {
   // Check if variable already exists in current scope
-  auto it = Variables.find(Name);
-  if (it != Variables.end() && it->second.ScopeLevel == CurrentScope) {
-    reportError("Variable '" + Name + "' already declared in this scope");
+  size_t ScopeStart = Scopes.empty() ? 0 : Scopes.back().FirstBinding;
+  auto It = Visible.find(Name);
+  if (It != Visible.end() && It->second >= ScopeStart) {
+    reportError("Variable '" + Name.str() +
+                "' already declared in this scope");
     return;
   }
 
   VariableState State;
   State.IsMutable = IsMutable;
-  State.ScopeLevel = CurrentScope;
+  State.ScopeLevel = Scopes.size();
   State.Line = CurrentLine;
-  Variables[Name] = State;
+  State.ResourceType = ResourceType;
+  int Shadowed = It != Visible.end() ? (int)It->second : -1;
+  Visible[Name] = Bindings.size();
+  Bindings.push_back({Name, State, Shadowed});
 }
 
-bool BorrowChecker::checkUse(const std::string &Name) {
-  auto it = Variables.find(Name);
-  if (it == Variables.end()) {
+bool BorrowChecker::checkUse(Symbol Name) {
+  VariableState *State = find(Name);
+  if (!State) {
     // Not tracked - might be a function parameter, allow it
     return true;
   }
 
-  if (it->second.IsMoved) {
-    reportError("Cannot use '" + Name + "': value has been moved");
+  if (State->IsMoved) {
+    reportError("Cannot use '" + Name.str() + "': value has been moved");
     return false;
   }
 
   return true;
 }
 
-bool BorrowChecker::checkAssign(const std::string &Name) {
-  auto it = Variables.find(Name);
-  if (it == Variables.end()) {
-    reportError("Cannot assign to undeclared variable '" + Name + "'");
+bool BorrowChecker::checkAssign(Symbol Name) {
+  VariableState *State = find(Name);
+  if (!State) {
+    reportError("Cannot assign to undeclared variable '" + Name.str() +
+                "'");
+    return false;
+  }
+
+  if (isShared(*State)) {
+    reportError("Cannot assign to '" + Name.str() +
+                "' in parallel code: it is shared between threads");
     return false;
   }
 
-  if (!it->second.IsMutable) {
-    reportError("Cannot assign to immutable variable '" + Name +
-                "'. Consider using 'let mut " + Name + "'");
+  if (!State->IsMutable) {
+    reportError("Cannot assign to immutable variable '" + Name.str() +
+                "'. Consider using 'let mut " + Name.str() + "'");
     return false;
   }
 
-  if (it->second.ImmutableBorrows > 0) {
-    reportError("Cannot assign to '" + Name +
+  if (State->ImmutableBorrows > 0) {
+    reportError("Cannot assign to '" + Name.str() +
                 "' while it is borrowed immutably");
     return false;
   }
 
-  if (it->second.MutableBorrows > 0) {
-    reportError("Cannot assign to '" + Name + "' while it is borrowed mutably");
+  if (State->MutableBorrows > 0) {
+    reportError("Cannot assign to '" + Name.str() +
+                "' while it is borrowed mutably");
     return false;
   }
 
   return true;
 }
 
-void BorrowChecker::moveVariable(const std::string &Name) {
-  auto it = Variables.find(Name);
-  if (it != Variables.end()) {
-    it->second.IsMoved = true;
-  }
+void BorrowChecker::moveVariable(Symbol Name) {
+  auto It = Visible.find(Name);
+  if (It == Visible.end())
+    return;
+  VariableState &State = Bindings[It->second].State;
+  if (isShared(State))
+    reportError("Cannot move '" + Name.str() +
+                "' in parallel code: it is shared between threads");
+  else if (isOutsideLoop(State))
+    reportError("Cannot move '" + Name.str() +
+                "' inside a loop: it is declared outside the loop");
+  // Inside an if, other branches are checked without this move
+  if (!State.IsMoved && !Branches.empty())
+    Moves.push_back(It->second);
+  State.IsMoved = true;
 }
 
-bool BorrowChecker::borrowImmutable(const std::string &Name) {
-  auto it = Variables.find(Name);
-  if (it == Variables.end()) {
+bool BorrowChecker::borrowImmutable(Symbol Name) {
+  VariableState *State = find(Name);
+  if (!State) {
     return true; // Not tracked
   }
 
-  if (it->second.IsMoved) {
-    reportError("Cannot borrow '" + Name + "': value has been moved");
+  if (State->IsMoved) {
+    reportError("Cannot borrow '" + Name.str() + "': value has been moved");
     return false;
   }
 
-  if (it->second.MutableBorrows > 0) {
-    reportError("Cannot borrow '" + Name +
+  if (State->MutableBorrows > 0) {
+    reportError("Cannot borrow '" + Name.str() +
                 "' as immutable: already borrowed as mutable");
     return false;
   }
 
-  it->second.ImmutableBorrows++;
+  State->ImmutableBorrows++;
   return true;
 }
 
-bool BorrowChecker::borrowMutable(const std::string &Name) {
-  auto it = Variables.find(Name);
-  if (it == Variables.end()) {
+bool BorrowChecker::borrowMutable(Symbol Name) {
+  VariableState *State = find(Name);
+  if (!State) {
     return true; // Not tracked
   }
 
-  if (it->second.IsMoved) {
-    reportError("Cannot borrow '" + Name + "': value has been moved");
+  if (State->IsMoved) {
+    reportError("Cannot borrow '" + Name.str() + "': value has been moved");
     return false;
   }
 
-  if (!it->second.IsMutable) {
-    reportError("Cannot borrow '" + Name +
+  if (!State->IsMutable) {
+    reportError("Cannot borrow '" + Name.str() +
                 "' as mutable: variable is not mutable");
     return false;
   }
 
-  if (it->second.ImmutableBorrows > 0) {
-    reportError("Cannot borrow '" + Name +
+  if (State->ImmutableBorrows > 0) {
+    reportError("Cannot borrow '" + Name.str() +
                 "' as mutable: already borrowed as immutable");
     return false;
   }
 
-  if (it->second.MutableBorrows > 0) {
-    reportError("Cannot borrow '" + Name +
+  if (State->MutableBorrows > 0) {
+    reportError("Cannot borrow '" + Name.str() +
                 "' as mutable more than once at a time");
     return false;
   }
 
-  it->second.MutableBorrows++;
+  State->MutableBorrows++;
   return true;
 }
 
-void BorrowChecker::releaseBorrow(const std::string &Name, bool Mutable) {
-  auto it = Variables.find(Name);
-  if (it != Variables.end()) {
+void BorrowChecker::releaseBorrow(Symbol Name, bool Mutable) {
+  VariableState *State = find(Name);
+  if (State) {
     if (Mutable) {
-      it->second.MutableBorrows--;
+      State->MutableBorrows--;
     } else {
-      it->second.ImmutableBorrows--;
+      State->ImmutableBorrows--;
     }
   }
 }
 
-bool BorrowChecker::exists(const std::string &Name) const {
-  return Variables.find(Name) != Variables.end();
+bool BorrowChecker::exists(Symbol Name) const {
+  return find(Name) != nullptr;
 }
 
-bool BorrowChecker::isMutable(const std::string &Name) const {
-  auto it = Variables.find(Name);
-  if (it != Variables.end()) {
-    return it->second.IsMutable;
+bool BorrowChecker::isMutable(Symbol Name) const {
+  const VariableState *State = find(Name);
+  if (State) {
+    return State->IsMutable;
   }
   return false;
 }
 
-void BorrowChecker::reportError(const std::string &Msg) {
-  std::ostringstream oss;
-  oss << "error: " << Msg;
-  Errors.push_back(oss.str());
+Symbol BorrowChecker::getResourceType(Symbol Name) const {
+  const VariableState *State = find(Name);
+  if (State) {
+    return State->ResourceType;
+  }
+  return Symbol();
+}
+
+void BorrowChecker::reportError(const llvm::Twine &Msg) {
+  Errors.push_back(("error: " + Msg).str());
 }
@@ -1,7 +1,9 @@
 #ifndef BORROWCHECK_H
 #define BORROWCHECK_H
 
-#include <map>
+#include "Symbol.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Twine.h"
 #include <string>
 #include <vector>
 
@@ -14,51 +16,137 @@ struct VariableState {
   int MutableBorrows = 0;    // Count of &mut x borrows (max 1)
   int ScopeLevel = 0;        // Scope where declared
   int Line = 0;              // Line where declared (for errors)
+  Symbol ResourceType;       // Droppable struct type, if an owned resource
 };
 
 /// Compile-time borrow checker
+///
+/// Variables are a stack of bindings, innermost last, and a scope is the
+/// bindings declared since it was entered. Leaving a scope pops those and
+/// brings back the outer variables they shadowed, which costs as much as
+/// the scope declared. Moves are tracked along control flow: each branch
+/// of an if is checked from the state before the if, and after it a
+/// variable counts as moved if any branch moved it.
 class BorrowChecker {
-  std::map<std::string, VariableState> Variables;
-  int CurrentScope = 0;
+  struct Binding {
+    Symbol Name;
+    VariableState State;
+    int Shadowed; // Binding of the same name this one hides, or -1
+  };
+
+  struct Scope {
+    size_t FirstBinding;
+    size_t FirstMove;
+  };
+
+  // An if being checked: its branches' moves are undone before the next
+  // branch is checked, and redone when the if ends
+  struct Branch {
+    size_t FirstMove;
+    std::vector<unsigned> Moved;
+  };
+
+  std::vector<Binding> Bindings;
+  llvm::DenseMap<Symbol, unsigned> Visible; // Innermost binding of a name
+  std::vector<Scope> Scopes;
+  std::vector<Branch> Branches;
+  std::vector<unsigned> Moves; // Bindings moved in the open branches
   std::vector<std::string> Errors;
   int CurrentLine = 1;
+  std::vector<int> ParallelScopes; // Scope enclosing each parallel region
+  std::vector<int> LoopScopes;     // Scope enclosing each loop
+
+  VariableState *find(Symbol Name);
+  const VariableState *find(Symbol Name) const;
+
+  /// Declared outside the innermost parallel region being parsed
+  bool isShared(const VariableState &State) const {
+    return !ParallelScopes.empty() && State.ScopeLevel <= ParallelScopes.back();
+  }
+
+  /// Declared outside the innermost loop being parsed
+  bool isOutsideLoop(const VariableState &State) const {
+    return !LoopScopes.empty() && State.ScopeLevel <= LoopScopes.back();
+  }
 
 public:
   /// Enter a new scope (function body, block, etc.)
-  void enterScope() { CurrentScope++; }
+  void enterScope() { Scopes.push_back({Bindings.size(), Moves.size()}); }
 
   /// Exit scope - releases all variables declared in this scope
   void exitScope();
 
+  /// Enter/exit code that runs concurrently with its surroundings: a
+  /// parallel loop body or a spawned task. Variables from outside it are
+  /// shared between threads and may only be read.
+  void enterParallel() {
+    ParallelScopes.push_back(Scopes.size());
+    enterScope();
+  }
+  void exitParallel() {
+    exitScope();
+    ParallelScopes.pop_back();
+  }
+
+  /// Enter/exit code that may run more than once: a loop body, and the
+  /// condition of a while. A variable from outside it cannot be moved there,
+  /// as the next iteration would use it again.
+  void enterLoop() {
+    LoopScopes.push_back(Scopes.size());
+    enterScope();
+  }
+  void exitLoop() {
+    exitScope();
+    LoopScopes.pop_back();
+  }
+
+  /// Check the branches of an if one after the other: beginBranch() before
+  /// the first, nextBranch() between them and endBranch() after the last
+  void beginBranch() { Branches.push_back({Moves.size(), {}}); }
+  void nextBranch();
+  void endBranch();
+
+  /// Scopes and branches are entered and left in pairs. After a parse
+  /// error, leave those entered since the depth was taken.
+  struct Depth {
+    size_t NumScopes, NumBranches;
+  };
+  Depth getDepth() const { return {Scopes.size(), Branches.size()}; }
+  void unwindTo(Depth D);
+
   /// Set current line for error reporting
   void setLine(int Line) { CurrentLine = Line; }
 
-  /// Declare a new variable
-  void declareVariable(const std::string &Name, bool IsMutable);
+  /// Declare a new variable, optionally owning a resource of the given type
+  void declareVariable(Symbol Name, bool IsMutable,
+                       Symbol ResourceType = Symbol());
 
   /// Check if variable can be used (not moved)
-  bool checkUse(const std::string &Name);
+  bool checkUse(Symbol Name);
 
   /// Check if variable can be assigned to (must be mutable)
-  bool checkAssign(const std::string &Name);
+  bool checkAssign(Symbol Name);
 
   /// Transfer ownership (move)
-  void moveVariable(const std::string &Name);
+  void moveVariable(Symbol Name);
 
   /// Borrow a variable immutably
-  bool borrowImmutable(const std::string &Name);
+  bool borrowImmutable(Symbol Name);
 
   /// Borrow a variable mutably
-  bool borrowMutable(const std::string &Name);
+  bool borrowMutable(Symbol Name);
 
   /// Release a borrow
-  void releaseBorrow(const std::string &Name, bool Mutable);
+  void releaseBorrow(Symbol Name, bool Mutable);
 
   /// Check if a variable exists
-  bool exists(const std::string &Name) const;
+  bool exists(Symbol Name) const;
 
   /// Check if variable is mutable
-  bool isMutable(const std::string &Name) const;
+  bool isMutable(Symbol Name) const;
+
+  /// Resource type owned by a variable, or empty if it owns none
+  Symbol getResourceType(Symbol Name) const;
 
   /// Get all errors
   const std::vector<std::string> &getErrors() const { return Errors; }
@@ -70,10 +158,10 @@ public:
   void clearErrors() { Errors.clear(); }
 
   /// Report an error
-  void reportError(const std::string &Msg);
+  void reportError(const llvm::Twine &Msg);
 };
 
 /// Global borrow checker instance
-extern BorrowChecker TheBorrowChecker;
+extern thread_local BorrowChecker TheBorrowChecker;
 
 #endif // BORROWCHECK_H
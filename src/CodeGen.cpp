@@ -3,36 +3,53 @@
 #include "Parser.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/xxhash.h"
+#include <cmath>
 #include <cstdio>
+#include <optional>
 
 // Global LLVM state definitions
-std::unique_ptr<LLVMContext> TheContext;
-std::unique_ptr<Module> TheModule;
-std::unique_ptr<IRBuilder<>> Builder;
-std::map<std::string, AllocaInst *> NamedValues;
-std::map<std::string, TypeInfo> VariableTypes;
+thread_local std::unique_ptr<LLVMContext> TheContext;
+thread_local std::unique_ptr<Module> TheModule;
+thread_local std::unique_ptr<IRBuilder<>> Builder;
+thread_local DenseMap<Symbol, VarBinding> NamedValues;
+thread_local DenseMap<Symbol, TypeInfo> VariableTypes;
 
 // JIT Engine
-std::unique_ptr<LLJIT> TheJIT;
+thread_local std::shared_ptr<LLJIT> TheJIT;
 ExitOnError ExitOnErr;
+thread_local JITDylib *CurrentDylib = nullptr;
 
 // Function prototypes map
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+thread_local DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
 // Counter for unique anonymous expression names
-unsigned AnonExprCounter = 0;
+thread_local unsigned AnonExprCounter = 0;
 
-// Struct type cache
-std::map<std::string, llvm::StructType *> LLVMStructTypes;
+
+// Scope-exit cleanups
+thread_local std::vector<Cleanup> Cleanups;
+thread_local DenseMap<Symbol, Cleanup> OwnedValues;
+
+// Set by --reassociate
+thread_local bool AllowReassociation = false;
+
+thread_local unsigned ErrorCount = 0;
+thread_local bool QuietErrors = false;
+thread_local bool ReloadableDefinitions = false;
 
 Value *LogErrorV(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+  ++ErrorCount;
+  if (!QuietErrors)
+    fprintf(stderr, "Error: %s\n", Str);
   return nullptr;
 }
 
@@ -43,8 +60,16 @@ void InitializeModuleAndPassManager() {
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
 }
 
-AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                   const std::string &VarName, Type *Ty) {
+void AddModuleToJIT() {
+  auto TSCtx = std::make_unique<ThreadSafeContext>(std::move(TheContext));
+  ExitOnErr(TheJIT->addIRModule(
+      *CurrentDylib,
+      ThreadSafeModule(std::move(TheModule), std::move(*TSCtx))));
+  InitializeModuleAndPassManager();
+}
+
+AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName,
+                                   Type *Ty) {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                    TheFunction->getEntryBlock().begin());
   if (!Ty)
@@ -61,20 +86,252 @@ Type *GetLLVMType(const TypeInfo &type) {
   case SpyType::Bool:
     return Type::getInt1Ty(*TheContext);
   case SpyType::String:
-    return PointerType::get(Type::getInt8Ty(*TheContext), 0);
-  case SpyType::Struct: {
-    auto it = LLVMStructTypes.find(type.StructName);
-    if (it != LLVMStructTypes.end())
-      return it->second;
-    return nullptr;
-  }
+    return Type::getDoubleTy(*TheContext); // Runtime string handle
+  case SpyType::Struct:
+    return getLLVMStructType(type.StructName);
+  case SpyType::Vec2:
+  case SpyType::Vec4:
+  case SpyType::Vec8:
+    return FixedVectorType::get(Type::getDoubleTy(*TheContext),
+                                type.vectorLanes());
   default:
     return Type::getDoubleTy(*TheContext);
   }
 }
 
-Function *getFunction(std::string Name) {
-  if (auto *F = TheModule->getFunction(Name))
+llvm::StructType *getLLVMStructType(Symbol Name) {
+  if (auto *Ty = llvm::StructType::getTypeByName(*TheContext, Name.str()))
+    return Ty;
+  auto It = StructTypes.find(Name);
+  if (It == StructTypes.end())
+    return nullptr;
+  std::vector<Type *> FieldTypes;
+  for (const auto &Field : It->second.Fields)
+    FieldTypes.push_back(GetLLVMType(Field.Type));
+  return llvm::StructType::create(*TheContext, FieldTypes, Name.str());
+}
+
+FunctionCallee getRuntimeFunction(const std::string &Name, unsigned NumArgs) {
+  std::vector<Type *> Doubles(NumArgs, Type::getDoubleTy(*TheContext));
+  FunctionType *FT =
+      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+  return TheModule->getOrInsertFunction(Name, FT);
+}
+
+static void emitCleanup(const Cleanup &C) {
+  if (!C.Slot) {
+    Builder->CreateCall(getRuntimeFunction("fermat_arena_end", 0));
+    return;
+  }
+
+  Function *DropF = getFunction(mangledName(C.DropFn, 1));
+  if (!DropF)
+    DropF = getFunction(C.DropFn);
+  if (!DropF) {
+    LogErrorV("Unknown drop function referenced");
+    return;
+  }
+
+  // Only drop if the value is still owned on this path
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *DropBB = BasicBlock::Create(*TheContext, "drop", TheFunction);
+  BasicBlock *ContBB = BasicBlock::Create(*TheContext, "dropcont", TheFunction);
+
+  Value *Owned =
+      Builder->CreateLoad(Type::getInt1Ty(*TheContext), C.Flag, "owned");
+  Builder->CreateCondBr(Owned, DropBB, ContBB);
+
+  Builder->SetInsertPoint(DropBB);
+  Value *Val = Builder->CreateLoad(C.Slot->getAllocatedType(), C.Slot);
+  Builder->CreateCall(DropF, {Val});
+  Builder->CreateStore(Builder->getFalse(), C.Flag);
+  Builder->CreateBr(ContBB);
+
+  Builder->SetInsertPoint(ContBB);
+}
+
+void emitCleanups(size_t Depth) {
+  for (size_t i = Cleanups.size(); i > Depth; --i)
+    emitCleanup(Cleanups[i - 1]);
+}
+
+void popCleanups(size_t Depth) {
+  emitCleanups(Depth);
+  Cleanups.resize(Depth);
+}
+
+// Parts of the function being generated that do not dominate the code
+// after them: the branches of an if, and the bodies and steps of loops.
+// Anything generated after a value, before the region it is defined in
+// closes, is dominated by it.
+static thread_local std::vector<unsigned> OpenRegions;
+static thread_local unsigned RegionCounter = 0;
+
+// Opens a region for the lifetime of the scope
+class RegionScope {
+public:
+  RegionScope() { OpenRegions.push_back(++RegionCounter); }
+  ~RegionScope() { OpenRegions.pop_back(); }
+};
+
+// Bind a variable that no code assigns to its value
+static void bindValue(Symbol Name, Value *V) {
+  VarBinding B;
+  B.Val = V;
+  B.Depth = OpenRegions.size();
+  B.Region = OpenRegions.empty() ? 0 : OpenRegions.back();
+  NamedValues[Name] = B;
+}
+
+// A slot for a variable bound to its value, made on first use and stored
+// to where the value is defined. Values other than instructions are
+// available from the start of the function.
+static AllocaInst *getSlot(VarBinding &B, Symbol Name) {
+  if (B.Slot)
+    return B.Slot;
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  B.Slot = CreateEntryBlockAlloca(TheFunction, Name.str(), B.Val->getType());
+  IRBuilder<> TmpB(*TheContext);
+  if (auto *Def = dyn_cast<Instruction>(B.Val)) {
+    BasicBlock *BB = Def->getParent();
+    TmpB.SetInsertPoint(BB, isa<PHINode>(Def) ? BB->getFirstInsertionPt()
+                                              : std::next(Def->getIterator()));
+  } else {
+    TmpB.SetInsertPoint(B.Slot->getNextNode());
+  }
+  TmpB.CreateStore(B.Val, B.Slot);
+  return B.Slot;
+}
+
+// The value of a variable at the insertion point: its bound value where
+// that dominates, and otherwise what its slot holds, as for any variable
+// that can be assigned
+static Value *readVariable(VarBinding &B, Symbol Name) {
+  if (B.Val) {
+    bool Open = B.Depth <= OpenRegions.size() &&
+                (B.Depth == 0 || OpenRegions[B.Depth - 1] == B.Region);
+    if (Open || !isa<Instruction>(B.Val))
+      return B.Val;
+  }
+  AllocaInst *Slot = getSlot(B, Name);
+  return Builder->CreateLoad(Slot->getAllocatedType(), Slot, Name.str());
+}
+
+// Locals of the current function copied into a struct, for code outlined
+// into a function that runs on another thread. The borrow checker ensures
+// that code only reads them. The first NumExtra fields hold values chosen
+// by the caller.
+struct CapturedEnv {
+  StructType *Ty = nullptr;
+  AllocaInst *Slot = nullptr;
+  unsigned NumExtra = 0;
+  std::vector<std::pair<Symbol, Value *>> Vars; // Values when captured
+};
+
+static CapturedEnv captureLocals(ArrayRef<Value *> Extra,
+                                 Symbol Exclude = Symbol()) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  CapturedEnv Env;
+  Env.NumExtra = Extra.size();
+
+  std::vector<Type *> Fields;
+  for (Value *V : Extra)
+    Fields.push_back(V->getType());
+  for (auto &[Name, Var] : NamedValues)
+    if (Name != Exclude)
+      Env.Vars.push_back({Name, readVariable(Var, Name)});
+  // In order of name, so that the layout does not depend on the symbols' IDs
+  llvm::sort(Env.Vars, [](const auto &A, const auto &B) {
+    return A.first.str() < B.first.str();
+  });
+  for (auto &[Name, V] : Env.Vars)
+    Fields.push_back(V->getType());
+
+  Env.Ty = StructType::get(*TheContext, Fields);
+  Env.Slot = CreateEntryBlockAlloca(TheFunction, "env", Env.Ty);
+  for (unsigned i = 0; i < Env.NumExtra; ++i)
+    Builder->CreateStore(Extra[i],
+                         Builder->CreateStructGEP(Env.Ty, Env.Slot, i));
+  for (size_t i = 0; i < Env.Vars.size(); ++i)
+    Builder->CreateStore(Env.Vars[i].second,
+                         Builder->CreateStructGEP(Env.Ty, Env.Slot,
+                                                  Env.NumExtra + i));
+  return Env;
+}
+
+// In the outlined function: bind the captured locals to variables of its
+// own and return the extra values. The borrow checker lets outlined code
+// assign to none of them, so they are bound to the values read from the
+// env, which nothing writes to while the function runs.
+static std::vector<Value *> bindCaptures(const CapturedEnv &Env,
+                                         Argument *EnvArg) {
+  EnvArg->addAttr(Attribute::NoAlias);
+  EnvArg->addAttr(Attribute::NoCapture);
+  EnvArg->addAttr(Attribute::ReadOnly);
+  Value *EnvPtr =
+      Builder->CreatePointerCast(EnvArg, PointerType::get(Env.Ty, 0));
+
+  std::vector<Value *> Extra;
+  for (unsigned i = 0; i < Env.NumExtra; ++i) {
+    Value *Field = Builder->CreateStructGEP(Env.Ty, EnvPtr, i);
+    Extra.push_back(Builder->CreateLoad(Env.Ty->getElementType(i), Field));
+  }
+  for (size_t i = 0; i < Env.Vars.size(); ++i) {
+    Symbol Name = Env.Vars[i].first;
+    unsigned Idx = Env.NumExtra + i;
+    Value *Field = Builder->CreateStructGEP(Env.Ty, EnvPtr, Idx);
+    bindValue(Name, Builder->CreateLoad(Env.Ty->getElementType(Idx), Field,
+                                        Name.str()));
+  }
+  return Extra;
+}
+
+// Coroutine of the async function being generated
+struct AsyncFrame {
+  Value *Id;
+  Value *Handle;
+  Value *Task;         // Returned to the caller on first suspension
+  BasicBlock *Cleanup; // Frees the frame
+  BasicBlock *Suspend; // Returns to whoever started or resumed it
+};
+
+// Null outside async functions, including in code outlined from them
+static thread_local AsyncFrame *CurrentAsync = nullptr;
+
+// Sets the enclosing function's codegen state aside while an outlined
+// function is generated, and restores it at the end of the scope
+class OutlineScope {
+  IRBuilderBase::InsertPoint SavedIP;
+  AsyncFrame *OuterAsync;
+  DenseMap<Symbol, VarBinding> OuterValues;
+  DenseMap<Symbol, Cleanup> OuterOwned;
+  std::vector<Cleanup> OuterCleanups;
+  std::vector<BasicBlock *> OuterEnds, OuterConds;
+  std::vector<size_t> OuterDepths;
+
+  void swapState() {
+    NamedValues.swap(OuterValues);
+    OwnedValues.swap(OuterOwned);
+    Cleanups.swap(OuterCleanups);
+    LoopEndBlocks.swap(OuterEnds);
+    LoopCondBlocks.swap(OuterConds);
+    LoopCleanupDepths.swap(OuterDepths);
+  }
+
+public:
+  OutlineScope() : SavedIP(Builder->saveIP()), OuterAsync(CurrentAsync) {
+    swapState();
+    CurrentAsync = nullptr;
+  }
+  ~OutlineScope() {
+    swapState();
+    CurrentAsync = OuterAsync;
+    Builder->restoreIP(SavedIP);
+  }
+};
+
+Function *getFunction(Symbol Name) {
+  if (auto *F = TheModule->getFunction(Name.str()))
     return F;
 
   auto FI = FunctionProtos.find(Name);
@@ -95,31 +352,38 @@ Value *NumberExprAST::codegen() {
 }
 
 Value *StringExprAST::codegen() {
-  return Builder->CreateGlobalString(Val, "str");
+  // Literals become interned runtime strings, so equal literals share a
+  // handle and can be used directly as map keys
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext),
+                                       {BytePtrTy, Int64Ty}, false);
+  FunctionCallee LitF = TheModule->getOrInsertFunction("fermat_str_lit", FT);
+
+  Value *Data = Builder->CreatePointerCast(
+      Builder->CreateGlobalString(Val, "str"), BytePtrTy);
+  Value *Len = ConstantInt::get(Int64Ty, Val.size());
+  return Builder->CreateCall(LitF, {Data, Len}, "strlit");
 }
 
 Value *VariableExprAST::codegen() {
-  Value *V = NamedValues[getName()];
-  if (!V) {
-    // Check for global variable
-    V = TheModule->getNamedGlobal(getName());
-  }
-
-  if (!V)
+  Value *Val = nullptr;
+  auto Local = NamedValues.find(Name);
+  if (Local != NamedValues.end())
+    Val = readVariable(Local->second, Name);
+  else if (GlobalVariable *GV = TheModule->getNamedGlobal(Name.str()))
+    Val = Builder->CreateLoad(GV->getValueType(), GV, Name.str());
+  else
     return LogErrorV("Unknown variable name");
 
-  // Handle both AllocaInst (local) and GlobalVariable (static)
-  Type *Ty = nullptr;
-  if (auto *Alloca = dyn_cast<AllocaInst>(V)) {
-    Ty = Alloca->getAllocatedType();
-  } else if (auto *GV = dyn_cast<GlobalVariable>(V)) {
-    Ty = GV->getValueType();
-  } else {
-    // Fallback / Error?
-    Ty = Type::getDoubleTy(*TheContext);
+  // Moving out of an owned variable: the new owner drops it
+  if (IsMove) {
+    auto Owned = OwnedValues.find(Name);
+    if (Owned != OwnedValues.end())
+      Builder->CreateStore(Builder->getFalse(), Owned->second.Flag);
   }
 
-  return Builder->CreateLoad(Ty, V, getName().c_str());
+  return Val;
 }
 
 Value *UnaryExprAST::codegen() {
@@ -139,8 +403,22 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
+  // A number combined with a vector applies to every lane
+  auto *LVec = dyn_cast<FixedVectorType>(L->getType());
+  auto *RVec = dyn_cast<FixedVectorType>(R->getType());
+  if (Op != ';' && (LVec || RVec)) {
+    if (LVec && RVec && LVec != RVec)
+      return LogErrorV("Vectors of different sizes in binary operator");
+    if (!LVec)
+      L = Builder->CreateVectorSplat(RVec->getNumElements(), L, "splat");
+    if (!RVec)
+      R = Builder->CreateVectorSplat(LVec->getNumElements(), R, "splat");
+  }
+
   // Handle integer vs float operations
   bool isIntOp = L->getType()->isIntegerTy() && R->getType()->isIntegerTy();
+  // Comparisons give 1.0 or 0.0, per lane on vectors
+  Type *FloatTy = L->getType();
 
   switch (Op) {
   case '+':
@@ -161,28 +439,28 @@ Value *BinaryExprAST::codegen() {
       return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
     }
     L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    return Builder->CreateUIToFP(L, FloatTy, "booltmp");
   case '>':
     if (isIntOp) {
       L = Builder->CreateICmpSGT(L, R, "cmptmp");
       return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
     }
     L = Builder->CreateFCmpUGT(L, R, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    return Builder->CreateUIToFP(L, FloatTy, "booltmp");
   case tok_eq:
     if (isIntOp) {
       L = Builder->CreateICmpEQ(L, R, "cmptmp");
       return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
     }
     L = Builder->CreateFCmpOEQ(L, R, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    return Builder->CreateUIToFP(L, FloatTy, "booltmp");
   case tok_ne:
     if (isIntOp) {
       L = Builder->CreateICmpNE(L, R, "cmptmp");
       return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
     }
     L = Builder->CreateFCmpONE(L, R, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    return Builder->CreateUIToFP(L, FloatTy, "booltmp");
   case ';':
     return R; // Return RHS (sequence operator)
   default:
@@ -190,16 +468,257 @@ Value *BinaryExprAST::codegen() {
   }
 }
 
+// Operations on the atomic cells of lib/parallel.frmt. A cell is a runtime
+// allocation holding an int64 or a double, and these builtins access it
+// with a single atomic instruction instead of calling into the runtime.
+// Functions the program defines itself take precedence.
+struct AtomicBuiltin {
+  enum Kind { Load, Store, RMW, CmpXchg } Op;
+  bool IsFloat; // Cell holds a double rather than an int64
+  AtomicRMWInst::BinOp RMWOp = AtomicRMWInst::BAD_BINOP;
+
+  size_t numArgs() const {
+    return Op == Load ? 1 : Op == CmpXchg ? 3 : 2;
+  }
+};
+
+static const std::map<StringRef, AtomicBuiltin> AtomicBuiltins = {
+    {"atomic_load", {AtomicBuiltin::Load, false}},
+    {"atomic_store", {AtomicBuiltin::Store, false}},
+    {"atomic_add", {AtomicBuiltin::RMW, false, AtomicRMWInst::Add}},
+    {"atomic_sub", {AtomicBuiltin::RMW, false, AtomicRMWInst::Sub}},
+    {"atomic_min", {AtomicBuiltin::RMW, false, AtomicRMWInst::Min}},
+    {"atomic_max", {AtomicBuiltin::RMW, false, AtomicRMWInst::Max}},
+    {"atomic_exchange", {AtomicBuiltin::RMW, false, AtomicRMWInst::Xchg}},
+    {"compare_exchange", {AtomicBuiltin::CmpXchg, false}},
+    {"atomic_fload", {AtomicBuiltin::Load, true}},
+    {"atomic_fstore", {AtomicBuiltin::Store, true}},
+    {"atomic_fadd", {AtomicBuiltin::RMW, true, AtomicRMWInst::FAdd}},
+    {"atomic_fsub", {AtomicBuiltin::RMW, true, AtomicRMWInst::FSub}},
+    {"atomic_fmin", {AtomicBuiltin::RMW, true, AtomicRMWInst::FMin}},
+    {"atomic_fmax", {AtomicBuiltin::RMW, true, AtomicRMWInst::FMax}},
+    {"atomic_fexchange", {AtomicBuiltin::RMW, true, AtomicRMWInst::Xchg}},
+    {"compare_fexchange", {AtomicBuiltin::CmpXchg, true}},
+};
+
+// Stores return the value stored, read-modify-write operations the cell's
+// previous value and compare-exchanges 1 if they stored the new value, 0
+// otherwise; floats are compared bit for bit
+static Value *emitAtomicBuiltin(const AtomicBuiltin &B,
+                                ArrayRef<ExprAST *> Args) {
+  std::vector<Value *> ArgsV;
+  for (ExprAST *Arg : Args) {
+    ArgsV.push_back(Arg->codegen());
+    if (!ArgsV.back())
+      return nullptr;
+  }
+
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *CellTy = B.IsFloat ? DoubleTy : Int64Ty;
+  // Compare-exchange only works on integers, so float cells use their bits
+  Type *AccessTy = B.Op == AtomicBuiltin::CmpXchg ? Int64Ty : CellTy;
+  Value *Cell = Builder->CreateIntToPtr(
+      Builder->CreateFPToUI(ArgsV[0], Int64Ty), PointerType::get(AccessTy, 0),
+      "cell");
+
+  auto ToCell = [&](Value *V) -> Value * {
+    if (B.IsFloat)
+      return B.Op == AtomicBuiltin::CmpXchg
+                 ? Builder->CreateBitCast(V, Int64Ty)
+                 : V;
+    return Builder->CreateFPToSI(V, Int64Ty);
+  };
+  auto FromCell = [&](Value *V) -> Value * {
+    return B.IsFloat ? V : Builder->CreateSIToFP(V, DoubleTy);
+  };
+  const Align CellAlign(8);
+  const AtomicOrdering Order = AtomicOrdering::SequentiallyConsistent;
+
+  switch (B.Op) {
+  case AtomicBuiltin::Load: {
+    LoadInst *Load = Builder->CreateAlignedLoad(CellTy, Cell, CellAlign);
+    Load->setAtomic(Order);
+    return FromCell(Load);
+  }
+  case AtomicBuiltin::Store: {
+    Value *V = ToCell(ArgsV[1]);
+    StoreInst *Store = Builder->CreateAlignedStore(V, Cell, CellAlign);
+    Store->setAtomic(Order);
+    return FromCell(V);
+  }
+  case AtomicBuiltin::RMW:
+    return FromCell(Builder->CreateAtomicRMW(B.RMWOp, Cell, ToCell(ArgsV[1]),
+                                             CellAlign, Order));
+  case AtomicBuiltin::CmpXchg: {
+    Value *Pair = Builder->CreateAtomicCmpXchg(
+        Cell, ToCell(ArgsV[1]), ToCell(ArgsV[2]), CellAlign, Order, Order);
+    Value *Stored = Builder->CreateExtractValue(Pair, 1);
+    return Builder->CreateUIToFP(Stored, DoubleTy, "booltmp");
+  }
+  }
+  return nullptr;
+}
+
+// SIMD vector builtins:
+//   vec2/vec4/vec8(x) or (x0, x1, ...)   splat x, or build from lanes
+//   lane(v i), with_lane(v i x)          extract or replace lane i
+//   shuffle(v i0 i1 ...)                 lanes of v at constant indices
+//   shuffle2(a b i0 i1 ...)              same over a's lanes, then b's
+//   hsum(v), hmin(v), hmax(v)            combine the lanes of v
+//   select(mask a b)                     a where mask is nonzero, else b
+static unsigned vectorConstructorLanes(StringRef Name) {
+  return Name == "vec2" ? 2 : Name == "vec4" ? 4 : Name == "vec8" ? 8 : 0;
+}
+
+// The argument counts a vector builtin takes, for an error message, or null
+// if Name is not one
+static const char *vectorBuiltinArity(StringRef Name) {
+  if (Name == "vec2")
+    return "1 or 2 arguments";
+  if (Name == "vec4")
+    return "1 or 4 arguments";
+  if (Name == "vec8")
+    return "1 or 8 arguments";
+  if (Name == "shuffle")
+    return "3, 5 or 9 arguments";
+  if (Name == "shuffle2")
+    return "4, 6 or 10 arguments";
+  if (Name == "hsum" || Name == "hmin" || Name == "hmax")
+    return "1 argument";
+  if (Name == "lane")
+    return "2 arguments";
+  if (Name == "with_lane" || Name == "select")
+    return "3 arguments";
+  return nullptr;
+}
+
+static bool isVectorBuiltin(StringRef Name, size_t NumArgs) {
+  if (unsigned Lanes = vectorConstructorLanes(Name))
+    return NumArgs == 1 || NumArgs == Lanes;
+  if (Name == "shuffle")
+    return NumArgs == 3 || NumArgs == 5 || NumArgs == 9;
+  if (Name == "shuffle2")
+    return NumArgs == 4 || NumArgs == 6 || NumArgs == 10;
+  if (Name == "hsum" || Name == "hmin" || Name == "hmax")
+    return NumArgs == 1;
+  if (Name == "lane")
+    return NumArgs == 2;
+  return (Name == "with_lane" || Name == "select") && NumArgs == 3;
+}
+
+static Value *emitVectorBuiltin(StringRef Name, ArrayRef<ExprAST *> Args) {
+  std::vector<Value *> ArgsV;
+  for (ExprAST *Arg : Args) {
+    ArgsV.push_back(Arg->codegen());
+    if (!ArgsV.back())
+      return nullptr;
+  }
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+
+  if (unsigned Lanes = vectorConstructorLanes(Name)) {
+    for (Value *V : ArgsV)
+      if (!V->getType()->isDoubleTy())
+        return LogErrorV("Vector lanes must be numbers");
+    if (ArgsV.size() == 1)
+      return Builder->CreateVectorSplat(Lanes, ArgsV[0], "splat");
+    Value *Vec = PoisonValue::get(FixedVectorType::get(DoubleTy, Lanes));
+    for (unsigned i = 0; i < Lanes; ++i)
+      Vec = Builder->CreateInsertElement(Vec, ArgsV[i], i);
+    return Vec;
+  }
+
+  if (Name == "select") {
+    Value *Mask = ArgsV[0];
+    if (ArgsV[1]->getType() != ArgsV[2]->getType() ||
+        (Mask->getType()->isVectorTy() &&
+         Mask->getType() != ArgsV[1]->getType()))
+      return LogErrorV("select needs a mask and values of matching types");
+    Mask = Builder->CreateFCmpONE(
+        Mask, Constant::getNullValue(Mask->getType()), "mask");
+    return Builder->CreateSelect(Mask, ArgsV[1], ArgsV[2], "select");
+  }
+
+  auto *VecTy = dyn_cast<FixedVectorType>(ArgsV[0]->getType());
+  if (!VecTy)
+    return LogErrorV("Expected a vector");
+
+  if (Name == "lane" || Name == "with_lane") {
+    if (!ArgsV[1]->getType()->isDoubleTy() ||
+        (Name == "with_lane" && !ArgsV[2]->getType()->isDoubleTy()))
+      return LogErrorV("Lane indices and values must be numbers");
+    unsigned Lanes = VecTy->getNumElements();
+    Value *Index;
+    if (auto *C = dyn_cast<ConstantFP>(ArgsV[1])) {
+      double Lane = C->getValueAPF().convertToDouble();
+      if (Lane < 0 || Lane >= Lanes || Lane != (int)Lane)
+        return LogErrorV("Lane index must be a lane number");
+      Index = ConstantInt::get(Int64Ty, (uint64_t)Lane);
+    } else {
+      // Vectors have a power of two lanes, so an index computed at run
+      // time wraps around instead of reaching past the last lane
+      Index = Builder->CreateFreeze(Builder->CreateFPToSI(ArgsV[1], Int64Ty));
+      Index = Builder->CreateAnd(Index, Lanes - 1, "laneidx");
+    }
+    if (Name == "lane")
+      return Builder->CreateExtractElement(ArgsV[0], Index, "lane");
+    return Builder->CreateInsertElement(ArgsV[0], ArgsV[2], Index);
+  }
+
+  if (Name == "hsum") {
+    // Lanes are added in order unless --reassociate allows a tree
+    Value *Sum = Builder->CreateFAddReduce(ConstantFP::get(DoubleTy, -0.0),
+                                           ArgsV[0]);
+    if (AllowReassociation) {
+      FastMathFlags FMF;
+      FMF.setAllowReassoc();
+      cast<Instruction>(Sum)->setFastMathFlags(FMF);
+    }
+    return Sum;
+  }
+  if (Name == "hmin")
+    return Builder->CreateFPMinReduce(ArgsV[0]);
+  if (Name == "hmax")
+    return Builder->CreateFPMaxReduce(ArgsV[0]);
+
+  // shuffle and shuffle2
+  size_t NumSources = Name == "shuffle2" ? 2 : 1;
+  if (NumSources == 2 && ArgsV[1]->getType() != VecTy)
+    return LogErrorV("shuffle2 needs two vectors of the same size");
+  std::vector<int> Mask;
+  for (size_t i = NumSources; i < ArgsV.size(); ++i) {
+    auto *Index = dyn_cast<ConstantFP>(ArgsV[i]);
+    double Lane = Index ? Index->getValueAPF().convertToDouble() : -1;
+    if (Lane < 0 || Lane >= NumSources * VecTy->getNumElements() ||
+        Lane != (int)Lane)
+      return LogErrorV("Shuffle indices must be lane numbers");
+    Mask.push_back((int)Lane);
+  }
+  if (NumSources == 1)
+    return Builder->CreateShuffleVector(ArgsV[0], Mask, "shuffle");
+  return Builder->CreateShuffleVector(ArgsV[0], ArgsV[1], Mask, "shuffle");
+}
+
 Value *CallExprAST::codegen() {
-  std::string MangledCallee = getMangledName();
   Function *CalleeF = getFunction(MangledCallee);
   if (!CalleeF) {
     // Fallback: try looking up original name (e.g. for externs)
     CalleeF = getFunction(Callee);
   }
 
-  if (!CalleeF)
+  if (!CalleeF) {
+    auto Builtin = AtomicBuiltins.find(Callee.str());
+    if (Builtin != AtomicBuiltins.end() &&
+        Builtin->second.numArgs() == Args.size())
+      return emitAtomicBuiltin(Builtin->second, Args);
+    if (const char *Arity = vectorBuiltinArity(Callee.str())) {
+      if (!isVectorBuiltin(Callee.str(), Args.size()))
+        return LogErrorV((Callee.str() + " takes " + Arity).str().c_str());
+      return emitVectorBuiltin(Callee.str(), Args);
+    }
     return LogErrorV("Unknown function referenced");
+  }
 
   if (CalleeF->arg_size() != Args.size())
     return LogErrorV("Incorrect # arguments passed");
@@ -209,6 +728,8 @@ Value *CallExprAST::codegen() {
     ArgsV.push_back(Args[i]->codegen());
     if (!ArgsV.back())
       return nullptr;
+    if (ArgsV.back()->getType() != CalleeF->getArg(i)->getType())
+      return LogErrorV("Argument type does not match the parameter's");
   }
 
   return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
@@ -221,16 +742,39 @@ Value *LetExprAST::codegen() {
   if (!InitVal)
     return nullptr;
 
-  Type *VarType = InitVal->getType();
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Name, VarType);
-  Builder->CreateStore(InitVal, Alloca);
-  NamedValues[Name] = Alloca;
+  // The borrow checker rejects assignments to an immutable variable, so
+  // one needs no slot unless it owns a value, which its drop reads from one
+  AllocaInst *Alloca = nullptr;
+  if (!isMutable() && DropFn.empty()) {
+    bindValue(Name, InitVal);
+  } else {
+    Alloca = CreateEntryBlockAlloca(TheFunction, Name.str(),
+                                    InitVal->getType());
+    Builder->CreateStore(InitVal, Alloca);
+    NamedValues[Name] = {Alloca};
+  }
+
+  // Owned resources get a drop flag, cleared on every path until set here
+  size_t Depth = Cleanups.size();
+  if (!DropFn.empty()) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    AllocaInst *Flag = TmpB.CreateAlloca(Type::getInt1Ty(*TheContext),
+                                         nullptr, Name.str() + ".owned");
+    TmpB.CreateStore(TmpB.getFalse(), Flag);
+    Builder->CreateStore(Builder->getTrue(), Flag);
+
+    Cleanup C{Alloca, Flag, DropFn};
+    Cleanups.push_back(C);
+    OwnedValues[Name] = C;
+  }
 
   Value *BodyVal = nullptr;
   if (Body) {
     BodyVal = Body->codegen();
     if (!BodyVal)
       return nullptr;
+    popCleanups(Depth);
   } else {
     BodyVal = InitVal;
   }
@@ -239,15 +783,27 @@ Value *LetExprAST::codegen() {
 }
 
 Value *AssignExprAST::codegen() {
-  AllocaInst *Variable = NamedValues[Name];
-  if (!Variable)
+  auto Local = NamedValues.find(Name);
+  if (Local == NamedValues.end())
     return LogErrorV("Unknown variable name for assignment");
+  // A variable bound to its value is only assigned to when it was left
+  // bound after its scope, and then holds the new value from here on
+  AllocaInst *Variable = getSlot(Local->second, Name);
+  Local->second.Val = nullptr;
 
   Value *Val = Value_->codegen();
   if (!Val)
     return nullptr;
 
+  // An owned variable drops its previous value and owns the new one
+  auto Owned = OwnedValues.find(Name);
+  if (Owned != OwnedValues.end())
+    emitCleanup(Owned->second);
+
   Builder->CreateStore(Val, Variable);
+
+  if (Owned != OwnedValues.end())
+    Builder->CreateStore(Builder->getTrue(), Owned->second.Flag);
   return Val;
 }
 
@@ -274,9 +830,13 @@ Value *IfExprAST::codegen() {
   Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
   Builder->SetInsertPoint(ThenBB);
-  Value *ThenV = Then->codegen();
-  if (!ThenV)
-    return nullptr;
+  Value *ThenV = nullptr;
+  {
+    RegionScope Branch;
+    ThenV = Then->codegen();
+    if (!ThenV)
+      return nullptr;
+  }
   Builder->CreateBr(MergeBB);
   ThenBB = Builder->GetInsertBlock();
 
@@ -285,6 +845,7 @@ Value *IfExprAST::codegen() {
 
   Value *ElseV = nullptr;
   if (Else) {
+    RegionScope Branch;
     ElseV = Else->codegen();
     if (!ElseV)
       return nullptr;
@@ -305,9 +866,12 @@ Value *IfExprAST::codegen() {
 }
 
 Value *ForExprAST::codegen() {
+  if (IsParallel)
+    return codegenParallel();
+
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName.str());
 
   Value *StartVal = Start->codegen();
   if (!StartVal)
@@ -317,11 +881,13 @@ Value *ForExprAST::codegen() {
 
   BasicBlock *CondBB = BasicBlock::Create(*TheContext, "forcond", TheFunction);
   BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "forloop");
+  BasicBlock *StepBB = BasicBlock::Create(*TheContext, "forstep");
   BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterfor");
 
-  // Push loop context for break/continue
-  LoopCondBlocks.push_back(CondBB);
+  // Push loop context for break/continue; continue still runs the step
+  LoopCondBlocks.push_back(StepBB);
   LoopEndBlocks.push_back(AfterBB);
+  LoopCleanupDepths.push_back(Cleanups.size());
 
   Builder->CreateBr(CondBB);
   Builder->SetInsertPoint(CondBB);
@@ -338,16 +904,33 @@ Value *ForExprAST::codegen() {
   TheFunction->insert(TheFunction->end(), LoopBB);
   Builder->SetInsertPoint(LoopBB);
 
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  auto Outer = NamedValues.find(VarName);
+  std::optional<VarBinding> OldVal;
+  if (Outer != NamedValues.end())
+    OldVal = Outer->second;
+  NamedValues[VarName] = {Alloca};
 
-  if (!Body->codegen())
-    return nullptr;
+  {
+    RegionScope LoopBody;
+    if (!Body->codegen())
+      return nullptr;
+  }
 
-  Value *StepVal =
-      Step ? Step->codegen() : ConstantFP::get(*TheContext, APFloat(1.0));
-  if (!StepVal)
-    return nullptr;
+  // Values owned by the body are dropped at the end of every iteration
+  popCleanups(LoopCleanupDepths.back());
+  Builder->CreateBr(StepBB);
+
+  TheFunction->insert(TheFunction->end(), StepBB);
+  Builder->SetInsertPoint(StepBB);
+
+  Value *StepVal = nullptr;
+  {
+    RegionScope LoopStep;
+    StepVal =
+        Step ? Step->codegen() : ConstantFP::get(*TheContext, APFloat(1.0));
+    if (!StepVal)
+      return nullptr;
+  }
 
   CurVar = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Alloca);
   Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
@@ -361,15 +944,278 @@ Value *ForExprAST::codegen() {
   // Pop loop context
   LoopCondBlocks.pop_back();
   LoopEndBlocks.pop_back();
+  LoopCleanupDepths.pop_back();
 
   if (OldVal)
-    NamedValues[VarName] = OldVal;
+    NamedValues[VarName] = *OldVal;
   else
     NamedValues.erase(VarName);
 
   return ConstantFP::get(*TheContext, APFloat(0.0));
 }
 
+// Iterations of "for i = start, end, step", which runs while i < end
+static Value *emitTripCount(Value *StartVal, Value *EndVal, Value *StepVal) {
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Value *Span = Builder->CreateFDiv(Builder->CreateFSub(EndVal, StartVal),
+                                    StepVal, "span");
+  Value *Count = Builder->CreateFPToSI(
+      Builder->CreateUnaryIntrinsic(Intrinsic::ceil, Span), Int64Ty, "count");
+  Value *Zero = ConstantFP::get(*TheContext, APFloat(0.0));
+  Value *Runs = Builder->CreateAnd(Builder->CreateFCmpOLT(StartVal, EndVal),
+                                   Builder->CreateFCmpOGT(StepVal, Zero));
+  return Builder->CreateSelect(Runs, Count, ConstantInt::get(Int64Ty, 0),
+                               "count");
+}
+
+// Loop over iterations [Lo, Hi) in an outlined range function, binding
+// VarName to Start + k * Step in iteration k. EmitIteration generates the
+// body of one iteration given the block that starts the next one, and
+// returns false on error.
+static bool
+emitRangeLoop(Value *Lo, Value *Hi, Value *StartVal, Value *StepVal,
+              Symbol VarName,
+              function_ref<bool(BasicBlock *NextBB)> EmitIteration) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+
+  AllocaInst *Index = CreateEntryBlockAlloca(TheFunction, "k", Int64Ty);
+  AllocaInst *Var = CreateEntryBlockAlloca(TheFunction, VarName.str());
+  Builder->CreateStore(Lo, Index);
+  NamedValues[VarName] = {Var};
+
+  BasicBlock *CondBB =
+      BasicBlock::Create(*TheContext, "rangecond", TheFunction);
+  BasicBlock *LoopBB =
+      BasicBlock::Create(*TheContext, "rangeloop", TheFunction);
+  BasicBlock *StepBB = BasicBlock::Create(*TheContext, "rangestep");
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterrange");
+
+  Builder->CreateBr(CondBB);
+  Builder->SetInsertPoint(CondBB);
+  Value *K = Builder->CreateLoad(Int64Ty, Index, "k");
+  Builder->CreateCondBr(Builder->CreateICmpSLT(K, Hi), LoopBB, AfterBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  Value *IVal = Builder->CreateFAdd(
+      StartVal,
+      Builder->CreateFMul(Builder->CreateSIToFP(K, DoubleTy), StepVal));
+  Builder->CreateStore(IVal, Var);
+  {
+    RegionScope Iteration;
+    if (!EmitIteration(StepBB))
+      return false;
+  }
+  Builder->CreateBr(StepBB);
+
+  TheFunction->insert(TheFunction->end(), StepBB);
+  Builder->SetInsertPoint(StepBB);
+  K = Builder->CreateLoad(Int64Ty, Index, "k");
+  Builder->CreateStore(Builder->CreateAdd(K, ConstantInt::get(Int64Ty, 1)),
+                       Index);
+  Builder->CreateBr(CondBB);
+
+  TheFunction->insert(TheFunction->end(), AfterBB);
+  Builder->SetInsertPoint(AfterBB);
+  return true;
+}
+
+// The body of a parallel for is outlined into
+//   void body(i64 lo, i64 hi, i8 *env)
+// which runs iterations [lo, hi). The runtime calls it on chunks of
+// [0, count) from its thread pool.
+Value *ForExprAST::codegenParallel() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+  Value *EndVal = End->codegen();
+  if (!EndVal)
+    return nullptr;
+  Value *StepVal = Step->codegen();
+  if (!StepVal)
+    return nullptr;
+
+  Value *Count = emitTripCount(StartVal, EndVal, StepVal);
+  CapturedEnv Env = captureLocals({StartVal, StepVal}, VarName);
+
+  FunctionType *BodyTy = FunctionType::get(
+      Type::getVoidTy(*TheContext), {Int64Ty, Int64Ty, BytePtrTy}, false);
+  Function *BodyF =
+      Function::Create(BodyTy, Function::InternalLinkage,
+                       TheFunction->getName() + ".parallel", TheModule.get());
+  auto ArgIt = BodyF->arg_begin();
+  Argument *Lo = ArgIt++, *Hi = ArgIt++, *EnvArg = ArgIt;
+  Lo->setName("lo");
+  Hi->setName("hi");
+  EnvArg->setName("env");
+
+  {
+    OutlineScope Outline;
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", BodyF);
+    Builder->SetInsertPoint(EntryBB);
+    std::vector<Value *> Extra = bindCaptures(Env, EnvArg);
+
+    bool Ok = emitRangeLoop(Lo, Hi, Extra[0], Extra[1], VarName,
+                            [&](BasicBlock *NextBB) {
+                              // continue moves to the next iteration; break
+                              // has nowhere to go
+                              LoopCondBlocks.push_back(NextBB);
+                              LoopEndBlocks.push_back(nullptr);
+                              LoopCleanupDepths.push_back(0);
+                              Value *BodyVal = Body->codegen();
+                              LoopCondBlocks.pop_back();
+                              LoopEndBlocks.pop_back();
+                              LoopCleanupDepths.pop_back();
+                              popCleanups(0);
+                              return BodyVal != nullptr;
+                            });
+    if (!Ok) {
+      BodyF->eraseFromParent();
+      return nullptr;
+    }
+    Builder->CreateRetVoid();
+    verifyFunction(*BodyF);
+  }
+
+  FunctionType *RunTy =
+      FunctionType::get(DoubleTy, {Int64Ty, BytePtrTy, BytePtrTy}, false);
+  FunctionCallee RunF =
+      TheModule->getOrInsertFunction("fermat_parallel_for", RunTy);
+  Value *BodyPtr = Builder->CreatePointerCast(BodyF, BytePtrTy);
+  Value *EnvPtr = Builder->CreatePointerCast(Env.Slot, BytePtrTy);
+  Builder->CreateCall(RunF, {Count, BodyPtr, EnvPtr});
+
+  return ConstantFP::get(*TheContext, APFloat(0.0));
+}
+
+// Combines two values with a reduction operator
+static Value *emitReduceOp(ReduceOp Op, Value *L, Value *R) {
+  Value *V = nullptr;
+  switch (Op) {
+  case ReduceOp::Min:
+    return Builder->CreateBinaryIntrinsic(Intrinsic::minnum, L, R);
+  case ReduceOp::Max:
+    return Builder->CreateBinaryIntrinsic(Intrinsic::maxnum, L, R);
+  case ReduceOp::Add:
+    V = Builder->CreateFAdd(L, R, "addtmp");
+    break;
+  case ReduceOp::Mul:
+    V = Builder->CreateFMul(L, R, "multmp");
+    break;
+  }
+
+  // Let LLVM regroup the accumulation too when the user opted in
+  if (AllowReassociation) {
+    FastMathFlags FMF;
+    FMF.setAllowReassoc();
+    cast<Instruction>(V)->setFastMathFlags(FMF);
+  }
+  return V;
+}
+
+static double reduceIdentity(ReduceOp Op) {
+  switch (Op) {
+  case ReduceOp::Add:
+    return 0.0;
+  case ReduceOp::Mul:
+    return 1.0;
+  case ReduceOp::Min:
+    return HUGE_VAL;
+  case ReduceOp::Max:
+    return -HUGE_VAL;
+  }
+  return 0.0;
+}
+
+// The body is outlined into
+//   double partial(i64 lo, i64 hi, i8 *env)
+// folding iterations [lo, hi) from the operator's identity. The runtime
+// runs chunks on its thread pool, folds their results into one partial per
+// worker and merges those in a tree. Floating-point + and * give different
+// results when regrouped, so unless --reassociate was passed they run as
+// a single in-order chunk on the calling thread instead.
+Value *ReduceExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+  Value *EndVal = End->codegen();
+  if (!EndVal)
+    return nullptr;
+  Value *StepVal = Step->codegen();
+  if (!StepVal)
+    return nullptr;
+
+  Value *Count = emitTripCount(StartVal, EndVal, StepVal);
+  CapturedEnv Env = captureLocals({StartVal, StepVal}, VarName);
+
+  FunctionType *PartialTy =
+      FunctionType::get(DoubleTy, {Int64Ty, Int64Ty, BytePtrTy}, false);
+  Function *PartialF =
+      Function::Create(PartialTy, Function::InternalLinkage,
+                       TheFunction->getName() + ".reduce", TheModule.get());
+  auto ArgIt = PartialF->arg_begin();
+  Argument *Lo = ArgIt++, *Hi = ArgIt++, *EnvArg = ArgIt;
+  Lo->setName("lo");
+  Hi->setName("hi");
+  EnvArg->setName("env");
+
+  {
+    OutlineScope Outline;
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", PartialF);
+    Builder->SetInsertPoint(EntryBB);
+    std::vector<Value *> Extra = bindCaptures(Env, EnvArg);
+
+    AllocaInst *Acc = CreateEntryBlockAlloca(PartialF, "acc");
+    Builder->CreateStore(ConstantFP::get(DoubleTy, reduceIdentity(Op)), Acc);
+
+    bool Ok = emitRangeLoop(Lo, Hi, Extra[0], Extra[1], VarName,
+                            [&](BasicBlock *) {
+                              Value *V = Body->codegen();
+                              if (!V)
+                                return false;
+                              popCleanups(0);
+                              Value *Cur = Builder->CreateLoad(DoubleTy, Acc);
+                              Builder->CreateStore(emitReduceOp(Op, Cur, V),
+                                                   Acc);
+                              return true;
+                            });
+    if (!Ok) {
+      PartialF->eraseFromParent();
+      return nullptr;
+    }
+    Builder->CreateRet(Builder->CreateLoad(DoubleTy, Acc, "acc"));
+    verifyFunction(*PartialF);
+  }
+
+  Value *EnvPtr = Builder->CreatePointerCast(Env.Slot, BytePtrTy);
+  bool Exact = Op == ReduceOp::Min || Op == ReduceOp::Max;
+  if (!Exact && !AllowReassociation)
+    return Builder->CreateCall(
+        PartialF, {ConstantInt::get(Int64Ty, 0), Count, EnvPtr}, "reduce");
+
+  FunctionType *RunTy = FunctionType::get(
+      DoubleTy, {Int64Ty, BytePtrTy, BytePtrTy, Int64Ty}, false);
+  FunctionCallee RunF =
+      TheModule->getOrInsertFunction("fermat_parallel_reduce", RunTy);
+  Value *PartialPtr = Builder->CreatePointerCast(PartialF, BytePtrTy);
+  Value *OpCode = ConstantInt::get(Int64Ty, (int64_t)Op);
+  return Builder->CreateCall(RunF, {Count, PartialPtr, EnvPtr, OpCode},
+                             "reduce");
+}
+
 Value *WhileExprAST::codegen() {
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
@@ -381,6 +1227,7 @@ Value *WhileExprAST::codegen() {
   // Push loop context for break/continue
   LoopCondBlocks.push_back(CondBB);
   LoopEndBlocks.push_back(AfterBB);
+  LoopCleanupDepths.push_back(Cleanups.size());
 
   Builder->CreateBr(CondBB);
   Builder->SetInsertPoint(CondBB);
@@ -399,9 +1246,13 @@ Value *WhileExprAST::codegen() {
   TheFunction->insert(TheFunction->end(), LoopBB);
   Builder->SetInsertPoint(LoopBB);
 
-  if (!Body->codegen())
-    return nullptr;
+  {
+    RegionScope LoopBody;
+    if (!Body->codegen())
+      return nullptr;
+  }
 
+  popCleanups(LoopCleanupDepths.back());
   Builder->CreateBr(CondBB);
 
   TheFunction->insert(TheFunction->end(), AfterBB);
@@ -410,6 +1261,7 @@ Value *WhileExprAST::codegen() {
   // Pop loop context
   LoopCondBlocks.pop_back();
   LoopEndBlocks.pop_back();
+  LoopCleanupDepths.pop_back();
 
   return ConstantFP::get(*TheContext, APFloat(0.0));
 }
@@ -417,7 +1269,10 @@ Value *WhileExprAST::codegen() {
 Value *BreakExprAST::codegen() {
   if (LoopEndBlocks.empty())
     return LogErrorV("break used outside of loop");
+  if (!LoopEndBlocks.back())
+    return LogErrorV("break cannot leave a parallel for loop");
 
+  emitCleanups(LoopCleanupDepths.back());
   Builder->CreateBr(LoopEndBlocks.back());
 
   // Create unreachable block for code after break
@@ -433,6 +1288,7 @@ Value *ContinueExprAST::codegen() {
   if (LoopCondBlocks.empty())
     return LogErrorV("continue used outside of loop");
 
+  emitCleanups(LoopCleanupDepths.back());
   Builder->CreateBr(LoopCondBlocks.back());
 
   // Create unreachable block for code after continue
@@ -444,41 +1300,191 @@ Value *ContinueExprAST::codegen() {
   return ConstantFP::get(*TheContext, APFloat(0.0));
 }
 
+Value *ArenaExprAST::codegen() {
+  Builder->CreateCall(getRuntimeFunction("fermat_arena_begin", 0));
+
+  // The region closes after the values owned by the body are dropped
+  size_t Depth = Cleanups.size();
+  Cleanups.push_back(Cleanup());
+
+  Value *BodyVal = Body->codegen();
+  if (!BodyVal)
+    return nullptr;
+
+  popCleanups(Depth);
+  return BodyVal;
+}
+
+// The spawned expression is outlined into double task(i8 *env). The
+// runtime copies env, so the future may outlive the spawning frame.
+Value *SpawnExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+
+  CapturedEnv Env = captureLocals({});
+
+  FunctionType *TaskTy = FunctionType::get(DoubleTy, {BytePtrTy}, false);
+  Function *TaskF =
+      Function::Create(TaskTy, Function::InternalLinkage,
+                       TheFunction->getName() + ".spawn", TheModule.get());
+  Argument *EnvArg = TaskF->arg_begin();
+  EnvArg->setName("env");
+
+  {
+    OutlineScope Outline;
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", TaskF);
+    Builder->SetInsertPoint(EntryBB);
+    bindCaptures(Env, EnvArg);
+
+    Value *Result = Body->codegen();
+    if (!Result) {
+      TaskF->eraseFromParent();
+      return nullptr;
+    }
+    popCleanups(0);
+    Builder->CreateRet(Result);
+    verifyFunction(*TaskF);
+  }
+
+  uint64_t EnvSize =
+      TheModule->getDataLayout().getTypeAllocSize(Env.Ty).getFixedValue();
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  FunctionType *SpawnTy =
+      FunctionType::get(DoubleTy, {BytePtrTy, BytePtrTy, Int64Ty}, false);
+  FunctionCallee SpawnF =
+      TheModule->getOrInsertFunction("fermat_spawn", SpawnTy);
+  Value *TaskPtr = Builder->CreatePointerCast(TaskF, BytePtrTy);
+  Value *EnvPtr = Builder->CreatePointerCast(Env.Slot, BytePtrTy);
+  return Builder->CreateCall(
+      SpawnF, {TaskPtr, EnvPtr, ConstantInt::get(Int64Ty, EnvSize)}, "future");
+}
+
+// Start the coroutine of an async function: allocate its frame and create
+// the task it returns
+static void beginCoroutine(Function *F, AsyncFrame &Frame) {
+  PointerType *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Value *Null = ConstantPointerNull::get(BytePtrTy);
+
+  F->setPresplitCoroutine();
+  Frame.Id = Builder->CreateIntrinsic(
+      Intrinsic::coro_id, {}, {Builder->getInt32(0), Null, Null, Null});
+  Value *Size = Builder->CreateIntrinsic(Intrinsic::coro_size, {Int64Ty}, {});
+  FunctionCallee Malloc =
+      TheModule->getOrInsertFunction("malloc", BytePtrTy, Int64Ty);
+  Value *Mem = Builder->CreateCall(Malloc, {Size}, "frame");
+  Frame.Handle = Builder->CreateIntrinsic(Intrinsic::coro_begin, {},
+                                         {Frame.Id, Mem}, nullptr, "hdl");
+  Frame.Task = Builder->CreateCall(getRuntimeFunction("fermat_task_create", 0),
+                                   {}, "task");
+  Frame.Cleanup = BasicBlock::Create(*TheContext, "coro.cleanup", F);
+  Frame.Suspend = BasicBlock::Create(*TheContext, "coro.suspend", F);
+}
+
+// Finish an async function with its result: complete the task, which
+// queues a waiting coroutine, then free the frame
+static void endCoroutine(AsyncFrame &Frame, Value *Result) {
+  Builder->CreateCall(getRuntimeFunction("fermat_task_complete", 2),
+                      {Frame.Task, Result});
+  Builder->CreateBr(Frame.Cleanup);
+
+  Builder->SetInsertPoint(Frame.Cleanup);
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+  Value *Mem = Builder->CreateIntrinsic(Intrinsic::coro_free, {},
+                                        {Frame.Id, Frame.Handle});
+  FunctionCallee Free = TheModule->getOrInsertFunction(
+      "free", Type::getVoidTy(*TheContext), BytePtrTy);
+  Builder->CreateCall(Free, {Mem});
+  Builder->CreateBr(Frame.Suspend);
+
+  // The ramp returns the task here; resumed parts just return. coro.end
+  // has an extra token operand since LLVM 18.
+  Builder->SetInsertPoint(Frame.Suspend);
+  Function *End =
+      Intrinsic::getDeclaration(TheModule.get(), Intrinsic::coro_end);
+  std::vector<Value *> EndArgs = {Frame.Handle, Builder->getFalse()};
+  if (End->arg_size() == 3)
+    EndArgs.push_back(ConstantTokenNone::get(*TheContext));
+  Builder->CreateCall(End, EndArgs);
+  Builder->CreateRet(Frame.Task);
+}
+
+Value *AwaitExprAST::codegen() {
+  Value *TaskV = Task->codegen();
+  if (!TaskV)
+    return nullptr;
+  if (!CurrentAsync)
+    return Builder->CreateCall(getRuntimeFunction("fermat_await", 1), {TaskV},
+                               "awaited");
+
+  // Suspend unless the task is already done. The event loop resumes the
+  // coroutine once it is.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *WaitBB = BasicBlock::Create(*TheContext, "await", TheFunction);
+  BasicBlock *ResumeBB =
+      BasicBlock::Create(*TheContext, "awaitcont", TheFunction);
+  Value *Ready = Builder->CreateCall(
+      getRuntimeFunction("fermat_task_ready", 1), {TaskV}, "ready");
+  Builder->CreateCondBr(
+      Builder->CreateFCmpONE(Ready, ConstantFP::get(*TheContext, APFloat(0.0))),
+      ResumeBB, WaitBB);
+
+  Builder->SetInsertPoint(WaitBB);
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *BytePtrTy = PointerType::get(Type::getInt8Ty(*TheContext), 0);
+  FunctionCallee SuspendF = TheModule->getOrInsertFunction(
+      "fermat_task_suspend",
+      FunctionType::get(DoubleTy, {DoubleTy, BytePtrTy}, false));
+  Value *Save = Builder->CreateIntrinsic(Intrinsic::coro_save, {},
+                                         {CurrentAsync->Handle});
+  Builder->CreateCall(SuspendF, {TaskV, CurrentAsync->Handle});
+  Value *State = Builder->CreateIntrinsic(Intrinsic::coro_suspend, {},
+                                          {Save, Builder->getFalse()});
+  SwitchInst *Switch = Builder->CreateSwitch(State, CurrentAsync->Suspend, 2);
+  Switch->addCase(Builder->getInt8(0), ResumeBB);
+  Switch->addCase(Builder->getInt8(1), CurrentAsync->Cleanup);
+
+  Builder->SetInsertPoint(ResumeBB);
+  return Builder->CreateCall(getRuntimeFunction("fermat_task_result", 1),
+                             {TaskV}, "awaited");
+}
+
 Value *StructExprAST::codegen() {
   auto it = StructTypes.find(StructName);
   if (it == StructTypes.end())
     return LogErrorV("Unknown struct type");
 
-  auto llvmIt = LLVMStructTypes.find(StructName);
-  if (llvmIt == LLVMStructTypes.end())
+  llvm::StructType *StructTy = getLLVMStructType(StructName);
+  if (!StructTy)
     return LogErrorV("LLVM struct type not found");
 
-  llvm::StructType *StructTy = llvmIt->second;
-
   // Allocate struct
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
   AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, "struct", StructTy);
 
   // Initialize fields
   const StructDef &Def = it->second;
-  for (size_t i = 0; i < Fields.size(); ++i) {
-    const auto &Field = Fields[i];
-
+  for (const FieldInit &Field : Fields) {
     // Find field index
     int FieldIdx = -1;
     for (size_t j = 0; j < Def.Fields.size(); ++j) {
-      if (Def.Fields[j].Name == Field.first) {
+      if (Def.Fields[j].Name == Field.Name) {
         FieldIdx = j;
         break;
       }
     }
 
     if (FieldIdx < 0) {
-      fprintf(stderr, "Unknown field: %s\n", Field.first.c_str());
+      if (QuietErrors)
+        ++ErrorCount;
+      else
+        fprintf(stderr, "Unknown field: %s\n", Field.Name.c_str());
       continue;
     }
 
-    Value *FieldVal = Field.second->codegen();
+    Value *FieldVal = Field.Value->codegen();
     if (!FieldVal)
       return nullptr;
 
@@ -499,7 +1505,7 @@ Value *MemberExprAST::codegen() {
   // Handle Struct Value (Reg) - VariableExpr returns loaded value
   if (ObjType->isStructTy()) {
     llvm::StructType *ST = cast<llvm::StructType>(ObjType);
-    std::string StructName = ST->getName().str();
+    Symbol StructName(ST->getName());
 
     // Look up field index
     auto it = StructTypes.find(StructName);
@@ -528,23 +1534,60 @@ Value *MemberExprAST::codegen() {
 // Function Code Generation
 //===----------------------------------------------------------------------===//
 
+// Parameters and results are passed as doubles, except SIMD vectors
+static Type *getParamType(const TypeInfo &T) {
+  return T.vectorLanes() ? GetLLVMType(T) : Type::getDoubleTy(*TheContext);
+}
+
 Function *PrototypeAST::codegen() {
-  // For now, all function parameters and return types are double
-  // Type annotations are parsed but type checking is deferred to future
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+  // Other type annotations are parsed but type checking is deferred to
+  // future
+  std::vector<Type *> ParamTypes;
+  for (const auto &Arg : Args)
+    ParamTypes.push_back(getParamType(Arg.Type));
 
   FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-  Function *F = Function::Create(FT, Function::ExternalLinkage, getName(),
-                                 TheModule.get());
+      FunctionType::get(getParamType(ReturnType), ParamTypes, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                 getName().str(), TheModule.get());
 
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++].Name);
+    Arg.setName(Args[Idx++].Name.str());
 
   return F;
 }
 
+// Rename the definition F after a hash of its module's code and define its
+// old name as a stub calling it through the pointer NAME.target, which a
+// reload sets to the new code. Recompiling unchanged source gives the same
+// name, which is how a reload tells which functions changed.
+static void makeReloadable(Function *F) {
+  Module &M = *F->getParent();
+  std::string Code;
+  raw_string_ostream OS(Code);
+  for (Function &G : M)
+    if (!G.isDeclaration())
+      G.print(OS);
+  std::string Name = F->getName().str();
+  F->setName(Name + "." + utohexstr(xxHash64(OS.str())));
+
+  Function *Stub = Function::Create(F->getFunctionType(),
+                                    Function::ExternalLinkage, Name, M);
+  auto *Target = new GlobalVariable(M, F->getType(), /*isConstant=*/false,
+                                    GlobalValue::ExternalLinkage, F,
+                                    Name + ".target");
+  IRBuilder<> B(BasicBlock::Create(*TheContext, "entry", Stub));
+  LoadInst *Callee = B.CreateLoad(F->getType(), Target, "callee");
+  Callee->setAtomic(AtomicOrdering::Acquire);
+  std::vector<Value *> Args;
+  for (Argument &Arg : Stub->args())
+    Args.push_back(&Arg);
+  CallInst *Call = B.CreateCall(F->getFunctionType(), Callee, Args);
+  Call->setTailCallKind(CallInst::TCK_MustTail);
+  B.CreateRet(Call);
+}
+
 Function *FunctionAST::codegen() {
   auto &P = *Proto;
   FunctionProtos[Proto->getName()] = std::move(Proto);
@@ -556,18 +1599,41 @@ Function *FunctionAST::codegen() {
   Builder->SetInsertPoint(BB);
 
   NamedValues.clear();
-  unsigned Idx = 0;
+  OwnedValues.clear();
+  Cleanups.clear();
+
+  AsyncFrame Frame;
+  if (P.isAsync()) {
+    beginCoroutine(TheFunction, Frame);
+    CurrentAsync = &Frame;
+  }
+
+  // Parameters are immutable, so they are bound to the arguments directly.
+  // A repeated parameter name refers to the first parameter of the name.
   for (auto &Arg : TheFunction->args()) {
-    AllocaInst *Alloca = CreateEntryBlockAlloca(
-        TheFunction, std::string(Arg.getName()), Arg.getType());
-    Builder->CreateStore(&Arg, Alloca);
-    NamedValues[std::string(Arg.getName())] = Alloca;
-    ++Idx;
+    Symbol Name = P.getArgs()[Arg.getArgNo()].Name;
+    if (!NamedValues.count(Name))
+      bindValue(Name, &Arg);
   }
 
-  if (Value *RetVal = Body->codegen()) {
-    Builder->CreateRet(RetVal);
+  Value *RetVal = Body->codegen();
+  CurrentAsync = nullptr;
+  Type *RetTy = P.isAsync() ? Type::getDoubleTy(*TheContext)
+                            : TheFunction->getReturnType();
+  if (RetVal && RetVal->getType() != RetTy)
+    RetVal = LogErrorV(RetVal->getType()->isVectorTy()
+                           ? "Function returns a vector; declare it -> vec2, "
+                             "-> vec4 or -> vec8"
+                           : "Function does not return its declared type");
+  if (RetVal) {
+    popCleanups(0);
+    if (P.isAsync())
+      endCoroutine(Frame, RetVal);
+    else
+      Builder->CreateRet(RetVal);
     verifyFunction(*TheFunction);
+    if (ReloadableDefinitions)
+      makeReloadable(TheFunction);
     return TheFunction;
   }
 
@@ -576,22 +1642,13 @@ Function *FunctionAST::codegen() {
 }
 
 void StructDefAST::codegen() {
-  std::vector<Type *> FieldTypes;
-  for (const auto &Field : Fields) {
-    FieldTypes.push_back(GetLLVMType(Field.Type));
-  }
-
-  llvm::StructType *StructTy =
-      llvm::StructType::create(*TheContext, FieldTypes, Name);
-  LLVMStructTypes[Name] = StructTy;
-
-  // Register in global struct registry
-  StructTypes[Name] = {Name, Fields};
+  // Register in global struct registry; the LLVM type is made on first use
+  StructTypes[Name] = {Name, Fields, DropFn};
 }
 
 void GlobalVarAST::codegen() {
-  TheModule->getOrInsertGlobal(Name, GetLLVMType(Type));
-  GlobalVariable *GVar = TheModule->getNamedGlobal(Name);
+  TheModule->getOrInsertGlobal(Name.str(), GetLLVMType(Type));
+  GlobalVariable *GVar = TheModule->getNamedGlobal(Name.str());
   GVar->setLinkage(GlobalValue::ExternalLinkage);
 
   // TODO: Add initializer support (requires constant expr or init function)
@@ -6,40 +6,96 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
-#include <map>
 #include <memory>
 #include <string>
 
 using namespace llvm;
 using namespace llvm::orc;
 
+// Compiler state. Each thread has its own; an Engine keeps a complete set
+// of it and swaps that in while it compiles (see Engine.cpp).
+
 // Global LLVM state
-extern std::unique_ptr<LLVMContext> TheContext;
-extern std::unique_ptr<Module> TheModule;
-extern std::unique_ptr<IRBuilder<>> Builder;
-extern std::map<std::string, AllocaInst *> NamedValues;
-extern std::map<std::string, TypeInfo> VariableTypes;
-
-// JIT Engine
-extern std::unique_ptr<LLJIT> TheJIT;
+extern thread_local std::unique_ptr<LLVMContext> TheContext;
+extern thread_local std::unique_ptr<Module> TheModule;
+extern thread_local std::unique_ptr<IRBuilder<>> Builder;
+
+// A local variable. Those the borrow checker lets no code assign to are
+// bound to their value rather than kept in a stack slot; a slot is still
+// made for reads the value does not dominate (see CodeGen.cpp).
+struct VarBinding {
+  AllocaInst *Slot = nullptr; // Storage, or null if not needed yet
+  Value *Val = nullptr;       // Value of a variable that is never assigned
+  unsigned Depth = 0;         // Region of code Val is defined in: its
+  unsigned Region = 0;        // nesting depth and number
+};
+
+extern thread_local DenseMap<Symbol, VarBinding> NamedValues;
+extern thread_local DenseMap<Symbol, TypeInfo> VariableTypes;
+
+// JIT Engine, shared by an Engine and its sessions
+extern thread_local std::shared_ptr<LLJIT> TheJIT;
 extern ExitOnError ExitOnErr;
 
-// Function prototypes map
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+// Dylib that new code is added to and top-level expressions are looked up
+// in: the main one, or in server mode the current script's own, or a
+// session's own
+extern thread_local JITDylib *CurrentDylib;
+
+// Function prototypes by the name their functions get in LLVM
+extern thread_local DenseMap<Symbol, std::unique_ptr<PrototypeAST>>
+    FunctionProtos;
 
 // Counter for unique anonymous expression names
-extern unsigned AnonExprCounter;
+extern thread_local unsigned AnonExprCounter;
+
+// LLVM type of a struct in the current context, created on first use in
+// each module since every module has a context of its own
+llvm::StructType *getLLVMStructType(Symbol Name);
+
+// Work to run when control leaves a scope: drop an owned value, or close an
+// arena region when Slot is null
+struct Cleanup {
+  AllocaInst *Slot = nullptr; // Owned value
+  AllocaInst *Flag = nullptr; // Drop flag, cleared when ownership moves
+  Symbol DropFn;
+};
 
-// Struct type cache
-extern std::map<std::string, llvm::StructType *> LLVMStructTypes;
+// Cleanups of the enclosing scopes, innermost last
+extern thread_local std::vector<Cleanup> Cleanups;
+
+// Owned local variables of the current function, by name
+extern thread_local DenseMap<Symbol, Cleanup> OwnedValues;
+
+// Allow floating-point + and * reductions to be regrouped and run in
+// parallel (--reassociate)
+extern thread_local bool AllowReassociation;
+
+// Number of errors reported, so a caller can tell whether its input
+// compiled cleanly
+extern thread_local unsigned ErrorCount;
+
+// Count errors without printing them, on a thread that compiles an imported
+// module ahead of its turn (see ModuleLoader.cpp)
+extern thread_local bool QuietErrors;
+
+// Emit each function definition under a name of its own, called through a
+// stub that a reload can point at new code (--watch, see HotReload.cpp)
+extern thread_local bool ReloadableDefinitions;
 
 // Helper functions
 Value *LogErrorV(const char *Str);
-Function *getFunction(std::string Name);
+Function *getFunction(Symbol Name);
+FunctionCallee getRuntimeFunction(const std::string &Name, unsigned NumArgs);
 void InitializeModuleAndPassManager();
-AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                   const std::string &VarName,
+void AddModuleToJIT(); // Hand TheModule to the JIT and start a new one
+AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName,
                                    Type *Ty = nullptr);
 Type *GetLLVMType(const TypeInfo &type);
 
+// Emit the cleanups above Depth, innermost first; popCleanups also removes
+// them (normal scope exit) while emitCleanups leaves them for other paths
+void emitCleanups(size_t Depth);
+void popCleanups(size_t Depth);
+
 #endif // CODEGEN_H
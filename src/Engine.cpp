@@ -0,0 +1,181 @@
+#include "Engine.h"
+#include "BorrowCheck.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "Lexer.h"
+#include "ModuleLoader.h"
+#include "Parser.h"
+#include "llvm/Support/TargetSelect.h"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Everything the compiler keeps in its thread_local globals. The JIT is
+// declared first so that it outlives the builder, module and context.
+struct EngineState {
+  std::shared_ptr<LLJIT> JIT;
+  bool IsSession = false;
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> Mod;
+  std::unique_ptr<IRBuilder<>> Build;
+  DenseMap<Symbol, VarBinding> Values;
+  DenseMap<Symbol, TypeInfo> Types;
+  JITDylib *Dylib = nullptr;
+  DenseMap<Symbol, std::unique_ptr<PrototypeAST>> Protos;
+  unsigned AnonCounter = 0;
+  std::vector<Cleanup> CleanupStack;
+  DenseMap<Symbol, Cleanup> Owned;
+  bool Reassociate = false;
+  std::map<int, int> Precedence;
+  std::string AnonName;
+  std::vector<BasicBlock *> EndBlocks, CondBlocks;
+  std::vector<size_t> CleanupDepths;
+  DenseMap<Symbol, StructDef> Structs;
+  BorrowChecker Borrows;
+  std::set<std::string> Modules;
+};
+
+// Make an engine's state the current thread's compiler state for the
+// lifetime of the scope, putting the thread's own state aside meanwhile
+class EngineScope {
+  EngineState &S;
+  LexerState SavedLexer;
+
+  void swapState() {
+    std::swap(TheJIT, S.JIT);
+    std::swap(TheContext, S.Context);
+    std::swap(TheModule, S.Mod);
+    std::swap(Builder, S.Build);
+    NamedValues.swap(S.Values);
+    VariableTypes.swap(S.Types);
+    std::swap(CurrentDylib, S.Dylib);
+    FunctionProtos.swap(S.Protos);
+    std::swap(AnonExprCounter, S.AnonCounter);
+    Cleanups.swap(S.CleanupStack);
+    OwnedValues.swap(S.Owned);
+    std::swap(AllowReassociation, S.Reassociate);
+    BinopPrecedence.swap(S.Precedence);
+    CurrentAnonName.swap(S.AnonName);
+    LoopEndBlocks.swap(S.EndBlocks);
+    LoopCondBlocks.swap(S.CondBlocks);
+    LoopCleanupDepths.swap(S.CleanupDepths);
+    StructTypes.swap(S.Structs);
+    std::swap(TheBorrowChecker, S.Borrows);
+    ImportedModules.swap(S.Modules);
+  }
+
+public:
+  EngineScope(EngineState &S) : S(S), SavedLexer(saveLexerState()) {
+    swapState();
+  }
+  ~EngineScope() {
+    swapState();
+    restoreLexerState(SavedLexer);
+  }
+};
+
+Engine::Engine() : State(std::make_unique<EngineState>()) {
+  static std::once_flag TargetInit;
+  std::call_once(TargetInit, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+
+  EngineScope Scope(*State);
+  InitializeBinopPrecedence();
+  ExitOnErr(InitializeJIT(/*ConcurrentCompilation=*/true));
+}
+
+Engine::Engine(std::unique_ptr<EngineState> State) : State(std::move(State)) {
+  EngineScope Scope(*this->State);
+  InitializeModuleAndPassManager();
+}
+
+Engine::~Engine() {
+  if (!State->IsSession)
+    return;
+  ExecutionSession &ES = State->JIT->getExecutionSession();
+  if (Error Err = ES.removeJITDylib(*State->Dylib))
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+}
+
+bool Engine::compile(const std::string &Source, const std::string &Path) {
+  return compile(Source.data(), Source.size(), Path);
+}
+
+// Compile the lexer's input, returning false if there were errors
+static bool compileInput() {
+  unsigned ErrorsBefore = ErrorCount;
+  getNextToken();
+  MainLoop();
+  return ErrorCount == ErrorsBefore;
+}
+
+bool Engine::compile(const char *Buffer, size_t Size,
+                     const std::string &Path) {
+  if (Size == 0)
+    return true;
+  EngineScope Scope(*State);
+  setInputString(std::string(Buffer, Size), Path);
+  return compileInput();
+}
+
+bool Engine::compileFile(const std::string &Path) {
+  EngineScope Scope(*State);
+  if (!setInputFile(Path)) {
+    fprintf(stderr, "Error: Could not open file %s\n", Path.c_str());
+    return false;
+  }
+  return compileInput();
+}
+
+void Engine::precompile() {
+  EngineScope Scope(*State);
+  CompileAllFunctions();
+}
+
+std::unique_ptr<Engine> Engine::createSession() {
+  static std::atomic<unsigned> SessionCounter{0};
+  ExecutionSession &ES = State->JIT->getExecutionSession();
+  JITDylib &Dylib = ExitOnErr(
+      ES.createJITDylib("session" + std::to_string(SessionCounter++)));
+
+  // Fall back to whatever this engine's own code can see
+  JITDylibSearchOrder Order;
+  State->Dylib->withLinkOrderDo(
+      [&](const JITDylibSearchOrder &Links) { Order = Links; });
+  for (auto &[JD, Flags] : Order)
+    Dylib.addToLinkOrder(*JD, Flags);
+
+  auto S = std::make_unique<EngineState>();
+  S->JIT = State->JIT;
+  S->IsSession = true;
+  S->Dylib = &Dylib;
+  for (auto &Entry : State->Protos)
+    S->Protos[Entry.first] = std::make_unique<PrototypeAST>(*Entry.second);
+  S->Reassociate = State->Reassociate;
+  S->Precedence = State->Precedence;
+  S->Structs = State->Structs;
+  S->Modules = State->Modules;
+  return std::unique_ptr<Engine>(new Engine(std::move(S)));
+}
+
+void *Engine::lookup(const std::string &Name, unsigned NumArgs) {
+  // Search the dylibs linked against as well, for a session's sake
+  JITDylibSearchOrder Order;
+  State->Dylib->withLinkOrderDo(
+      [&](const JITDylibSearchOrder &Links) { Order = Links; });
+  std::string Mangled = Name + "$" + std::to_string(NumArgs);
+  auto Sym = State->JIT->getExecutionSession().lookup(
+      Order, State->JIT->mangleAndIntern(Mangled));
+  if (!Sym) {
+    consumeError(Sym.takeError());
+    return nullptr;
+  }
+  ExecutorAddr Addr(Sym->getAddress());
+  return Addr.toPtr<void *>();
+}
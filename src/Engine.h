@@ -0,0 +1,89 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <memory>
+#include <string>
+#include <type_traits>
+
+struct EngineState;
+
+// A Fermat compiler and JIT for embedding in a host program (libfermat).
+//
+// Each Engine has its own context, modules, JIT and parser state, so
+// engines are independent of each other and of the fermat executable's
+// own compiler. Engines may be used from several threads at once, but each
+// one from a single thread at a time.
+//
+//   Engine E;
+//   E.compile("def mix(a b) a * 0.25 + b * 0.75");
+//   auto *Mix = E.getFunction<double(double, double)>("mix");
+//   double x = Mix(1.0, 2.0);
+//
+// To compile many scripts in parallel on top of the same libraries, compile
+// the libraries once and give each thread a session of that engine:
+//
+//   Engine Base;
+//   Base.compile("import \"lib/collections.frmt\"");
+//   Base.precompile();
+//   // on each thread
+//   auto S = Base.createSession();
+//   S->compile(Script);
+class Engine {
+public:
+  Engine();
+  ~Engine();
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+
+  // Compile Source as a script at Path; imports are resolved relative to
+  // it. Top-level expressions run as they are compiled, and definitions
+  // stay available to later calls. Errors are printed to stderr; returns
+  // false if there were any.
+  bool compile(const std::string &Source,
+               const std::string &Path = "./<engine>");
+  bool compile(const char *Buffer, size_t Size,
+               const std::string &Path = "./<engine>");
+
+  // Compile the script file at Path
+  bool compileFile(const std::string &Path);
+
+  // Compile every function defined so far now rather than when first used,
+  // e.g. libraries before their engine is shared by sessions
+  void precompile();
+
+  // A new engine that shares this one's JIT and starts out with its
+  // definitions, imports and types. Its own code goes into a JIT dylib of
+  // its own and is removed along with it; it can redefine functions without
+  // affecting this engine or other sessions. Sessions compile and run in
+  // parallel with each other. Create them while this engine is not
+  // compiling.
+  std::unique_ptr<Engine> createSession();
+
+  // Address of the compiled function Name taking NumArgs arguments, or
+  // null if there is none
+  void *lookup(const std::string &Name, unsigned NumArgs);
+
+  // Typed version of lookup. Every Fermat value is a double, so FnT must
+  // be double(double...).
+  template <typename FnT> FnT *getFunction(const std::string &Name) {
+    static_assert(Signature<FnT>::IsFermat,
+                  "Fermat functions take and return doubles");
+    return reinterpret_cast<FnT *>(lookup(Name, Signature<FnT>::NumArgs));
+  }
+
+private:
+  explicit Engine(std::unique_ptr<EngineState> State);
+
+  template <typename FnT> struct Signature {
+    static constexpr bool IsFermat = false;
+  };
+  template <typename R, typename... Args> struct Signature<R(Args...)> {
+    static constexpr bool IsFermat = std::is_same_v<R, double> &&
+                                     (std::is_same_v<Args, double> && ...);
+    static constexpr unsigned NumArgs = sizeof...(Args);
+  };
+
+  std::unique_ptr<EngineState> State;
+};
+
+#endif // ENGINE_H
@@ -0,0 +1,296 @@
+#include "HotReload.h"
+#include "BorrowCheck.h"
+#include "CodeGen.h"
+#include "ModuleLoader.h"
+#include "Parser.h"
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace {
+// A function that can be reloaded: the definition its stub calls, and the
+// stub's type, which a new definition has to keep
+struct Reloadable {
+  std::string Impl;
+  std::string Type;
+};
+
+// The watched files, and the compiler state to reload them in: the
+// importer's after each load, so a module sees at least what it saw when it
+// was first loaded
+struct Watcher {
+  std::mutex Lock;
+  std::map<std::string, Reloadable> Functions; // By stub name
+  std::set<std::string> Files;
+  std::map<int, std::string> Dirs; // By inotify watch descriptor
+  std::shared_ptr<LLJIT> JIT;
+  JITDylib *Dylib = nullptr;
+  DenseMap<Symbol, std::unique_ptr<PrototypeAST>> Protos;
+  DenseMap<Symbol, StructDef> Structs;
+  std::map<int, int> Precedence;
+  bool Reassociate = false;
+  int Inotify = -1;
+  int Wake[2] = {-1, -1}; // Written to by stopWatching
+  std::thread Thread;
+};
+} // namespace
+
+// Never destroyed, as the script may exit with the thread still running
+static Watcher &watcher() {
+  static Watcher *W = new Watcher;
+  return *W;
+}
+
+static std::string typeName(Type *T) {
+  std::string Name;
+  raw_string_ostream OS(Name);
+  T->print(OS);
+  return OS.str();
+}
+
+void noteReloadable(Module &M) {
+  Watcher &W = watcher();
+  std::lock_guard<std::mutex> Guard(W.Lock);
+  for (GlobalVariable &GV : M.globals()) {
+    StringRef Stub = GV.getName();
+    if (Stub.consume_back(".target") && GV.hasInitializer()) {
+      auto *Impl = cast<Function>(GV.getInitializer());
+      W.Functions[Stub.str()] = {Impl->getName().str(),
+                                 typeName(Impl->getFunctionType())};
+    }
+  }
+}
+
+#ifdef __linux__
+// Add a module of a reloaded file to the JIT and point the stub of its
+// function at the new code. Returns false if the function did not change,
+// or cannot be reloaded.
+static bool reloadModule(ThreadSafeModule TSM) {
+  Watcher &W = watcher();
+  std::string Stub, Impl, Type;
+  bool Replaces = false, Add = true;
+  TSM.withModuleDo([&](Module &M) {
+    GlobalVariable *Target = nullptr;
+    for (GlobalVariable &GV : M.globals()) {
+      StringRef Name = GV.getName();
+      if (Name.consume_back(".target")) {
+        Target = &GV;
+        Stub = Name.str();
+      } else if (!GV.isDeclaration() && !GV.hasLocalLinkage()) {
+        // A static defined already keeps its storage
+        if (auto Sym = TheJIT->lookup(*CurrentDylib, Name); Sym)
+          GV.setInitializer(nullptr);
+        else
+          consumeError(Sym.takeError());
+      }
+    }
+    if (!Target) {
+      // New statics after the last definition, if any
+      Add = any_of(M.globals(),
+                   [](GlobalVariable &GV) { return !GV.isDeclaration(); });
+      return;
+    }
+
+    auto *F = cast<Function>(Target->getInitializer());
+    Impl = F->getName().str();
+    Type = typeName(F->getFunctionType());
+    std::lock_guard<std::mutex> Guard(W.Lock);
+    auto It = W.Functions.find(Stub);
+    if (It == W.Functions.end())
+      return; // A new function, added with its stub
+    if (It->second.Impl == Impl) {
+      Add = false;
+    } else if (It->second.Type != Type) {
+      fprintf(stderr,
+              "Error: Cannot reload %s: its parameter or return types "
+              "changed\n",
+              Stub.substr(0, Stub.rfind('$')).c_str());
+      Add = false;
+    } else {
+      // Only the new code; the stub in the JIT calls it once retargeted
+      Target->eraseFromParent();
+      M.getFunction(Stub)->deleteBody();
+      Replaces = true;
+    }
+  });
+  if (!Add)
+    return false;
+
+  // The code of a change that was undone is in the JIT already
+  bool Compiled = false;
+  if (Replaces) {
+    if (auto Sym = TheJIT->lookup(*CurrentDylib, Impl); Sym)
+      Compiled = true;
+    else
+      consumeError(Sym.takeError());
+  }
+  if (!Compiled) {
+    if (Error Err = TheJIT->addIRModule(*CurrentDylib, std::move(TSM))) {
+      logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+      return false;
+    }
+  }
+  if (Stub.empty())
+    return false;
+
+  if (Replaces) {
+    // Compile the new code before any caller can reach it
+    auto Code = TheJIT->lookup(*CurrentDylib, Impl);
+    auto Slot = TheJIT->lookup(*CurrentDylib, Stub + ".target");
+    if (!Code || !Slot) {
+      logAllUnhandledErrors(joinErrors(Code.takeError(), Slot.takeError()),
+                            errs(), "Error: ");
+      return false;
+    }
+    auto CodeAddr = *Code;
+    auto SlotAddr = *Slot;
+    __atomic_store_n(SlotAddr.toPtr<void **>(), CodeAddr.toPtr<void *>(),
+                     __ATOMIC_RELEASE);
+  }
+  std::lock_guard<std::mutex> Guard(W.Lock);
+  W.Functions[Stub] = {Impl, Type};
+  return true;
+}
+
+// Compile the module at Path again, in the watcher's compiler state, and
+// switch the functions whose code changed over to the new code. A module
+// with errors is left as it was.
+static void reloadFile(const std::string &Path) {
+  Watcher &W = watcher();
+  {
+    std::lock_guard<std::mutex> Guard(W.Lock);
+    TheJIT = W.JIT;
+    CurrentDylib = W.Dylib;
+    AllowReassociation = W.Reassociate;
+    BinopPrecedence = W.Precedence;
+    StructTypes = W.Structs;
+    FunctionProtos.clear();
+    for (auto &Entry : W.Protos)
+      FunctionProtos[Entry.first] =
+          std::make_unique<PrototypeAST>(*Entry.second);
+  }
+  TheBorrowChecker = BorrowChecker();
+  ErrorCount = 0;
+  WatchImports = true;
+  InitializeModuleAndPassManager();
+
+  std::vector<ThreadSafeModule> Modules;
+  bool Read = recompileModule(Path, Modules);
+  for (const auto &Err : TheBorrowChecker.getErrors()) {
+    fprintf(stderr, "%s\n", Err.c_str());
+    ++ErrorCount;
+  }
+  if (!Read || ErrorCount) {
+    fprintf(stderr, "Error: Not reloading %s\n", Path.c_str());
+  } else {
+    unsigned Changed = 0;
+    for (ThreadSafeModule &M : Modules)
+      Changed += reloadModule(std::move(M));
+    fprintf(stderr, "Reloaded %s: %u function%s changed\n", Path.c_str(),
+            Changed, Changed == 1 ? "" : "s");
+
+    // Modules reloaded later see the new definitions
+    std::lock_guard<std::mutex> Guard(W.Lock);
+    for (auto &Entry : FunctionProtos)
+      W.Protos[Entry.first] = std::move(Entry.second);
+    for (auto &Entry : StructTypes)
+      W.Structs[Entry.first] = Entry.second;
+  }
+
+  // The modules must go before their contexts
+  Modules.clear();
+  Builder.reset();
+  TheModule.reset();
+  TheContext.reset();
+}
+
+// Read the events of the directories of watched files until stopWatching,
+// reloading each file that was written to. Editors save in more than one
+// step, so a file is reloaded once its events stop for a moment.
+static void watchLoop() {
+  Watcher &W = watcher();
+  pollfd Fds[2] = {{W.Inotify, POLLIN, 0}, {W.Wake[0], POLLIN, 0}};
+  while (poll(Fds, 2, -1) >= 0 && !(Fds[1].revents & POLLIN)) {
+    std::set<std::string> Changed;
+    do {
+      alignas(inotify_event) char Buf[4096];
+      ssize_t Len = read(W.Inotify, Buf, sizeof(Buf));
+      std::lock_guard<std::mutex> Guard(W.Lock);
+      for (ssize_t Pos = 0; Pos < Len;) {
+        auto *Event = reinterpret_cast<inotify_event *>(Buf + Pos);
+        auto Dir = W.Dirs.find(Event->wd);
+        if (Event->len && Dir != W.Dirs.end()) {
+          std::string Path = Dir->second + "/" + Event->name;
+          if (W.Files.count(Path))
+            Changed.insert(Path);
+        }
+        Pos += sizeof(inotify_event) + Event->len;
+      }
+    } while (poll(Fds, 1, 50) > 0);
+
+    for (const std::string &Path : Changed)
+      reloadFile(Path);
+  }
+}
+
+void watchModules(const std::vector<std::string> &Paths) {
+  Watcher &W = watcher();
+  std::lock_guard<std::mutex> Guard(W.Lock);
+  if (W.Inotify < 0) {
+    W.Inotify = inotify_init1(IN_CLOEXEC);
+    if (W.Inotify < 0 || pipe(W.Wake) != 0) {
+      perror("Error: Cannot watch modules");
+      WatchImports = false;
+      return;
+    }
+  }
+
+  for (const std::string &Path : Paths) {
+    W.Files.insert(Path);
+    std::string Dir = getFileDirectory(Path);
+    int Wd = inotify_add_watch(W.Inotify, Dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (Wd < 0)
+      fprintf(stderr, "Error: Cannot watch %s\n", Dir.c_str());
+    else
+      W.Dirs[Wd] = Dir;
+  }
+
+  W.JIT = TheJIT;
+  W.Dylib = CurrentDylib;
+  W.Reassociate = AllowReassociation;
+  W.Precedence = BinopPrecedence;
+  for (auto &Entry : FunctionProtos)
+    W.Protos[Entry.first] = std::make_unique<PrototypeAST>(*Entry.second);
+  for (auto &Entry : StructTypes)
+    W.Structs[Entry.first] = Entry.second;
+
+  if (!W.Thread.joinable())
+    W.Thread = std::thread(watchLoop);
+}
+
+#else
+// Files are watched with inotify, which only Linux has
+void watchModules(const std::vector<std::string> &) {
+  fprintf(stderr, "Error: --watch is not supported on this platform\n");
+  WatchImports = false;
+}
+#endif
+
+void stopWatching() {
+  Watcher &W = watcher();
+  if (W.Thread.joinable() && write(W.Wake[1], "", 1) == 1)
+    W.Thread.join();
+  std::lock_guard<std::mutex> Guard(W.Lock);
+  W.JIT.reset();
+}
@@ -0,0 +1,27 @@
+#ifndef HOTRELOAD_H
+#define HOTRELOAD_H
+
+#include "llvm/IR/Module.h"
+#include <string>
+#include <vector>
+
+// Watch mode (--watch): when the file of an imported module changes, it is
+// compiled again on a thread of its own while the script keeps running.
+// Every function of an imported module is called through a stub (see
+// makeReloadable in CodeGen.cpp), which is pointed at the new code of each
+// function whose code changed, so callers run it from their next call on.
+// Statics keep their storage, and with it their values.
+
+// Take note of the reloadable functions of a module about to be added to
+// the JIT
+void noteReloadable(llvm::Module &M);
+
+// Watch the files of modules that were just loaded, reloading them in the
+// current compiler state as it is now
+void watchModules(const std::vector<std::string> &Paths);
+
+// Stop watching, waiting for a reload in progress. Call it before the JIT
+// is destroyed.
+void stopWatching();
+
+#endif // HOTRELOAD_H
@@ -3,17 +3,30 @@
 #include "CodeGen.h"
 #include "Lexer.h"
 #include "Parser.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
 #include <cstdio>
-#include <unistd.h>
 
 using namespace llvm;
 using namespace llvm::orc;
 
+// Runtime.cpp output buffer
+extern "C" double fermat_flush();
+
 static bool checkBorrowErrors() {
   if (TheBorrowChecker.hasErrors()) {
     for (const auto &Err : TheBorrowChecker.getErrors()) {
       fprintf(stderr, "%s\n", Err.c_str());
+      ++ErrorCount;
     }
     TheBorrowChecker.clearErrors();
     return true;
@@ -21,19 +34,150 @@ static bool checkBorrowErrors() {
   return false;
 }
 
+// Async functions are emitted as presplit coroutines. The O0 pipeline
+// consists of little more than the coroutine passes, which split each one
+// into a ramp, a resume and a destroy function.
+static void lowerCoroutines(Module &M) {
+  if (!M.getFunction("llvm.coro.begin"))
+    return;
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM = PB.buildO0DefaultPipeline(OptimizationLevel::O0);
+  MPM.run(M, MAM);
+}
+
+namespace {
+// Machine code of compiled modules, kept in a directory under a hash of
+// the module's bitcode and of the target it was compiled for. Every
+// definition is a module of its own, so a run of an edited script only
+// compiles the definitions whose code changed, along with those whose
+// code depends on what changed, such as callers of a function whose
+// signature changed.
+class DiskObjectCache : public ObjectCache {
+  std::string Dir;
+  std::string Target; // Triple, CPU, features and LLVM version
+
+  std::string pathFor(const Module &M) {
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    OS << Target;
+    WriteBitcodeToFile(M, OS);
+    return Dir + "/" + toHex(SHA1::hash(arrayRefFromStringRef(OS.str())),
+                             /*LowerCase=*/true) + ".o";
+  }
+
+public:
+  DiskObjectCache(std::string Dir, const JITTargetMachineBuilder &JTMB)
+      : Dir(std::move(Dir)),
+        Target(JTMB.getTargetTriple().str() + " " + JTMB.getCPU() + " " +
+               JTMB.getFeatures().getString() + " " LLVM_VERSION_STRING) {}
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    // writeToOutput renames a temporary file into place, so a run reading
+    // the cache at the same time never sees part of an object
+    if (Error Err = writeToOutput(pathFor(*M), [&](raw_ostream &OS) {
+          OS << Obj.getBuffer();
+          return Error::success();
+        }))
+      consumeError(std::move(Err));
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    auto Obj = MemoryBuffer::getFile(pathFor(*M));
+    return Obj ? std::move(*Obj) : nullptr;
+  }
+};
+} // namespace
+
+void CompileAllFunctions() {
+  for (auto &Entry : FunctionProtos) {
+    if (auto Sym = TheJIT->lookup(*CurrentDylib, Entry.first.str()); !Sym)
+      consumeError(Sym.takeError());
+  }
+}
+
+Error InitializeJIT(bool ConcurrentCompilation, const std::string &CacheDir) {
+  ObjectCache *Cache = nullptr;
+  if (!CacheDir.empty()) {
+    std::error_code EC = sys::fs::create_directories(CacheDir);
+    if (!EC && !sys::fs::is_directory(CacheDir))
+      EC = std::make_error_code(std::errc::not_a_directory);
+    if (EC)
+      return createStringError(EC, "cannot use cache directory %s: %s",
+                               CacheDir.c_str(), EC.message().c_str());
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
+    // Never destroyed, as the JIT compiles with it for as long as it lives
+    Cache = new DiskObjectCache(CacheDir, *JTMB);
+  }
+
+  LLJITBuilder JITBuilder;
+  // A compiler per module rather than one shared TargetMachine, so that
+  // threads looking up code in different modules compile it in parallel
+  if (ConcurrentCompilation)
+    JITBuilder.setCompileFunctionCreator(
+        [Cache](JITTargetMachineBuilder JTMB)
+            -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+          return std::make_unique<ConcurrentIRCompiler>(std::move(JTMB),
+                                                        Cache);
+        });
+  // Otherwise the single compiler LLJIT would make, given the cache
+  else if (Cache)
+    JITBuilder.setCompileFunctionCreator(
+        [Cache](JITTargetMachineBuilder JTMB)
+            -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+          auto TM = JTMB.createTargetMachine();
+          if (!TM)
+            return TM.takeError();
+          return std::make_unique<TMOwningSimpleCompiler>(std::move(*TM),
+                                                          Cache);
+        });
+  auto JITExpected = JITBuilder.create();
+  if (!JITExpected)
+    return JITExpected.takeError();
+  TheJIT = std::move(*JITExpected);
+  CurrentDylib = &TheJIT->getMainJITDylib();
+
+  // Register host process symbols for Runtime.cpp
+  const char dl_pre[2] = {0, 0}; // Empty prefix for dlsym
+  auto Generator =
+      DynamicLibrarySearchGenerator::GetForCurrentProcess(dl_pre[0]);
+  if (!Generator)
+    return Generator.takeError();
+  TheJIT->getMainJITDylib().addGenerator(std::move(*Generator));
+
+  TheJIT->getIRTransformLayer().setTransform(
+      [](ThreadSafeModule TSM, MaterializationResponsibility &)
+          -> Expected<ThreadSafeModule> {
+        TSM.withModuleDo(lowerCoroutines);
+        return TSM;
+      });
+
+  InitializeModuleAndPassManager();
+  return Error::success();
+}
+
 void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
     if (checkBorrowErrors())
       return;
 
     if (auto *FnIR = FnAST->codegen()) {
-      if (isatty(fileno(InputFile)))
+      if (isInteractive())
         fprintf(stderr, "Parsed function definition.\n");
 
-      auto TSCtx = std::make_unique<ThreadSafeContext>(std::move(TheContext));
-      ExitOnErr(TheJIT->addIRModule(
-          ThreadSafeModule(std::move(TheModule), std::move(*TSCtx))));
-      InitializeModuleAndPassManager();
+      AddModuleToJIT();
     }
   } else {
     getNextToken();
@@ -43,7 +187,7 @@ void HandleDefinition() {
 void HandleExport() {
   fprintf(stderr, "DEBUG: Parsing Export\n");
   getNextToken(); // eat 'export'
-  if (CurTok == tok_def) {
+  if (CurTok == tok_def || CurTok == tok_async) {
     HandleDefinition();
   } else if (CurTok == tok_type || CurTok == tok_struct) {
     HandleStructDef();
@@ -61,7 +205,7 @@ void HandleImport() {
 void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
     if (auto *FnIR = ProtoAST->codegen()) {
-      if (isatty(fileno(InputFile)))
+      if (isInteractive())
         fprintf(stderr, "Parsed an extern\n");
       FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
@@ -74,7 +218,7 @@ void HandleExtern() {
 void HandleStaticVar() {
   if (auto GlobalAST = ParseStaticVar()) {
     GlobalAST->codegen();
-    if (isatty(fileno(InputFile)))
+    if (isInteractive())
       fprintf(stderr, "Parsed static variable.\n");
   } else {
     getNextToken();
@@ -84,7 +228,7 @@ void HandleStaticVar() {
 void HandleStructDef() {
   if (auto StructAST = ParseStructDef()) {
     StructAST->codegen();
-    if (isatty(fileno(InputFile))) {
+    if (isInteractive()) {
       if (StructAST->isAbstract())
         fprintf(stderr, "Parsed abstract struct definition.\n");
       else
@@ -101,16 +245,16 @@ void HandleTopLevelExpression() {
       return;
 
     if (FnAST->codegen()) {
-      auto TSCtx = std::make_unique<ThreadSafeContext>(std::move(TheContext));
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(*TSCtx));
-      ExitOnErr(TheJIT->addIRModule(std::move(TSM)));
-      InitializeModuleAndPassManager();
+      AddModuleToJIT();
 
-      auto ExprSymbol = ExitOnErr(TheJIT->lookup(CurrentAnonName + "$0"));
+      auto ExprSymbol =
+          ExitOnErr(TheJIT->lookup(*CurrentDylib, CurrentAnonName + "$0"));
       auto *FP = ExprSymbol.toPtr<double (*)()>();
       double val = FP();
-      if (isatty(fileno(InputFile)))
+      if (isInteractive()) {
+        fermat_flush();
         fprintf(stdout, "%.10g\n", val);
+      }
     }
   } else {
     getNextToken();
@@ -119,7 +263,7 @@ void HandleTopLevelExpression() {
 
 void MainLoop() {
   while (true) {
-    if (isatty(fileno(InputFile)))
+    if (isInteractive())
       fprintf(stderr, "ready> ");
 
     switch (CurTok) {
@@ -129,6 +273,7 @@ void MainLoop() {
       getNextToken();
       break;
     case tok_def:
+    case tok_async:
       HandleDefinition();
       break;
     case tok_export:
@@ -153,5 +298,7 @@ void MainLoop() {
       HandleTopLevelExpression();
       break;
     }
+    // The item is compiled and nothing refers to its AST any more
+    TheASTArena.reset();
   }
 }
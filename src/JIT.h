@@ -1,9 +1,24 @@
 #ifndef JIT_H
 #define JIT_H
 
+#include "llvm/Support/Error.h"
+#include <string>
+
 // Main interpreter loop
 void MainLoop();
 
+// Create TheJIT, which resolves Runtime.cpp functions in the host process
+// and splits the coroutines of async functions, and start a fresh module.
+// ConcurrentCompilation lets several threads compile code at once, as the
+// sessions of an Engine do. With a CacheDir, machine code is kept there and
+// reused by later runs that compile the same code.
+llvm::Error InitializeJIT(bool ConcurrentCompilation = false,
+                         const std::string &CacheDir = "");
+
+// Compile the code of every function in FunctionProtos now instead of on
+// first call
+void CompileAllFunctions();
+
 // Handler functions
 void HandleDefinition();
 void HandleExtern();
@@ -1,212 +1,498 @@
 #include "Lexer.h"
 #include "Parser.h"
-#include <cctype>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 // Global lexer state
-std::string IdentifierStr;
-std::string StringValue;
-double NumVal;
-FILE *InputFile = nullptr;
-std::string CurrentFilePath;
+thread_local Symbol IdentifierSym;
+thread_local std::string_view IdentifierStr;
+thread_local std::string_view StringValue;
+thread_local double NumVal;
 
-static int LastChar = ' ';
+//===----------------------------------------------------------------------===//
+// Source Buffers
+//===----------------------------------------------------------------------===//
 
-void setInputFile(FILE *file, const std::string &path) {
-  InputFile = file;
-  CurrentFilePath = path;
-  LastChar = ' ';
+// A token of the input. Identifiers keep their symbol's ID in Payload,
+// numbers and string literals the index of their value.
+struct LexedToken {
+  int Kind;
+  uint32_t Offset; // of the token's first character in the text
+  uint32_t Payload;
+};
+
+// The whole text being lexed, followed by a NUL so that scanning loops stop
+// at the end without checking bounds, and the tokens lexed from it, ending
+// with tok_eof. A NUL before the end is lexed as a character. A terminal is
+// read and lexed a line at a time instead, as the parser asks for tokens.
+struct SourceBuffer {
+  std::string Path;
+  std::string Text;
+  void *Mapped = nullptr;
+  size_t MappedSize = 0;
+  FILE *Terminal = nullptr;
+  std::vector<LexedToken> Tokens;
+  std::vector<double> Numbers;
+  std::deque<std::string> Strings;
+  size_t Unlexed = 0; // terminal text still to be lexed
+
+  SourceBuffer() = default;
+  SourceBuffer(const SourceBuffer &) = delete;
+  SourceBuffer &operator=(const SourceBuffer &) = delete;
+  ~SourceBuffer() {
+    if (Mapped)
+      munmap(Mapped, MappedSize);
+  }
+
+  const char *begin() const {
+    return Mapped ? static_cast<const char *>(Mapped) : Text.c_str();
+  }
+  const char *end() const {
+    return Mapped ? begin() + MappedSize : Text.c_str() + Text.size();
+  }
+  bool complete() const {
+    return !Tokens.empty() && Tokens.back().Kind == tok_eof;
+  }
+
+  void lexAll();
+  void lexLine();
+
+private:
+  size_t lex(size_t From, bool MoreInput);
+};
+
+static std::shared_ptr<SourceBuffer> readFile(const std::string &Path) {
+  int Fd = open(Path.c_str(), O_RDONLY);
+  if (Fd < 0)
+    return nullptr;
+  auto Buffer = std::make_shared<SourceBuffer>();
+  struct stat St;
+  bool Ok = fstat(Fd, &St) == 0;
+  if (Ok && St.st_size > UINT32_MAX) { // too big for 32-bit token offsets
+    close(Fd);
+    return nullptr;
+  }
+
+  // Bytes past the end of a file in its last page read as zero, which
+  // serves as the NUL. A file that fills its last page exactly has no room
+  // for one and is read instead.
+  long PageSize = sysconf(_SC_PAGESIZE);
+  if (Ok && S_ISREG(St.st_mode) && St.st_size > 0 &&
+      St.st_size % PageSize != 0) {
+    void *Map = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (Map != MAP_FAILED) {
+      Buffer->Mapped = Map;
+      Buffer->MappedSize = St.st_size;
+      close(Fd);
+      return Buffer;
+    }
+  }
+
+  if (Ok && S_ISREG(St.st_mode))
+    Buffer->Text.reserve(St.st_size);
+  char Chunk[65536];
+  ssize_t n;
+  while ((n = read(Fd, Chunk, sizeof(Chunk))) > 0)
+    Buffer->Text.append(Chunk, n);
+  close(Fd);
+  if (!Ok || n < 0)
+    return nullptr;
+  return Buffer;
 }
 
-LexerState saveLexerState() {
-  LexerState state;
-  state.File = InputFile;
-  state.FilePath = CurrentFilePath;
-  state.LastChar = LastChar;
-  state.CurToken = CurTok;
-  state.IdentStr = IdentifierStr;
-  state.StrVal = StringValue;
-  state.NumValue = NumVal;
-  return state;
+//===----------------------------------------------------------------------===//
+// Character Classes
+//===----------------------------------------------------------------------===//
+
+enum CharClassBits : uint8_t {
+  CC_Space = 1,       // isspace
+  CC_IdentStart = 2,  // letters and '_'
+  CC_IdentBody = 4,   // letters, digits and '_'
+  CC_NumberBody = 8,  // digits and '.'
+  CC_LineEnd = 16,    // '\n', '\r' and NUL end a comment
+  CC_StringStop = 32, // '"', '\\' and NUL interrupt a string literal
+};
+
+struct CharClassTable {
+  uint8_t Bits[256] = {};
+};
+
+static constexpr CharClassTable buildCharClasses() {
+  CharClassTable T;
+  for (char C : {' ', '\t', '\n', '\v', '\f', '\r'})
+    T.Bits[(unsigned char)C] |= CC_Space;
+  for (int C = 0; C < 256; ++C) {
+    bool Letter = (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z');
+    bool Digit = C >= '0' && C <= '9';
+    if (Letter || C == '_')
+      T.Bits[C] |= CC_IdentStart | CC_IdentBody;
+    if (Digit)
+      T.Bits[C] |= CC_IdentBody | CC_NumberBody;
+  }
+  T.Bits[(unsigned char)'.'] |= CC_NumberBody;
+  for (char C : {'\n', '\r', '\0'})
+    T.Bits[(unsigned char)C] |= CC_LineEnd;
+  for (char C : {'"', '\\', '\0'})
+    T.Bits[(unsigned char)C] |= CC_StringStop;
+  return T;
 }
 
-void restoreLexerState(const LexerState &state) {
-  InputFile = state.File;
-  CurrentFilePath = state.FilePath;
-  LastChar = state.LastChar;
-  CurTok = state.CurToken;
-  IdentifierStr = state.IdentStr;
-  StringValue = state.StrVal;
-  NumVal = state.NumValue;
+static constexpr CharClassTable CharClasses = buildCharClasses();
+
+static inline bool hasClass(const char *P, uint8_t Class) {
+  return CharClasses.Bits[(unsigned char)*P] & Class;
 }
 
-int gettok() {
-  while (isspace(LastChar))
-    LastChar = fgetc(InputFile);
-
-  // Identifier and keywords
-  if (isalpha(LastChar) || LastChar == '_') {
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = fgetc(InputFile))) || LastChar == '_')
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "let")
-      return tok_let;
-    if (IdentifierStr == "mut")
-      return tok_mut;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "while")
-      return tok_while;
-    if (IdentifierStr == "do")
-      return tok_do;
-    if (IdentifierStr == "end")
-      return tok_end;
-    if (IdentifierStr == "import")
-      return tok_import;
-    if (IdentifierStr == "export")
-      return tok_export;
-    if (IdentifierStr == "break")
-      return tok_break;
-    if (IdentifierStr == "continue")
-      return tok_continue;
-    if (IdentifierStr == "type")
-      return tok_type;
-    if (IdentifierStr == "struct")
-      return tok_struct;
-    if (IdentifierStr == "int")
-      return tok_int;
-    if (IdentifierStr == "float")
-      return tok_float;
-    if (IdentifierStr == "string")
-      return tok_string;
-    if (IdentifierStr == "bool")
-      return tok_bool;
-    if (IdentifierStr == "static")
-      return tok_static;
-    if (IdentifierStr == "abstract")
-      return tok_abstract;
+//===----------------------------------------------------------------------===//
+// Keywords
+//===----------------------------------------------------------------------===//
+
+namespace {
+struct Keyword {
+  std::string_view Name;
+  int Tok;
+};
+} // namespace
+
+static constexpr Keyword Keywords[] = {
+    {"def", tok_def}, {"extern", tok_extern}, {"let", tok_let},
+    {"mut", tok_mut}, {"if", tok_if}, {"then", tok_then}, {"else", tok_else},
+    {"for", tok_for}, {"in", tok_in}, {"while", tok_while}, {"do", tok_do},
+    {"end", tok_end}, {"import", tok_import}, {"export", tok_export},
+    {"break", tok_break}, {"continue", tok_continue}, {"type", tok_type},
+    {"struct", tok_struct}, {"int", tok_int}, {"float", tok_float},
+    {"string", tok_string}, {"bool", tok_bool}, {"static", tok_static},
+    {"abstract", tok_abstract}, {"with", tok_with}, {"drop", tok_drop},
+    {"parallel", tok_parallel}, {"spawn", tok_spawn}, {"reduce", tok_reduce},
+    {"async", tok_async}, {"await", tok_await},
+};
+
+// No two keywords share their length, first and last letter, so those make
+// the key. A multiplier that sends every keyword's key to a different slot
+// is searched for at compile time, which makes a lookup one multiply and
+// one comparison.
+static constexpr unsigned KeywordTableBits = 7;
+
+static constexpr uint32_t keywordKey(std::string_view Name) {
+  return (uint32_t)(unsigned char)Name.front() |
+         (uint32_t)(unsigned char)Name.back() << 8 |
+         (uint32_t)Name.size() << 16;
+}
+
+static constexpr unsigned keywordSlot(uint32_t Key, uint32_t Multiplier) {
+  return (Key * Multiplier) >> (32 - KeywordTableBits);
+}
+
+static constexpr uint32_t findKeywordMultiplier() {
+  for (uint32_t M = 0x9E3779B1; M < 0x9E3779B1 + 20000; M += 2) {
+    bool Used[1 << KeywordTableBits] = {};
+    bool Perfect = true;
+    for (const Keyword &K : Keywords) {
+      unsigned Slot = keywordSlot(keywordKey(K.Name), M);
+      if (Used[Slot]) {
+        Perfect = false;
+        break;
+      }
+      Used[Slot] = true;
+    }
+    if (Perfect)
+      return M;
+  }
+  return 0;
+}
+
+static constexpr uint32_t KeywordMultiplier = findKeywordMultiplier();
+static_assert(KeywordMultiplier != 0, "no perfect hash for the keywords");
+
+struct KeywordTable {
+  Keyword Slots[1 << KeywordTableBits] = {};
+  size_t MinLength = ~size_t(0), MaxLength = 0;
+};
+
+static constexpr KeywordTable buildKeywordTable() {
+  KeywordTable T;
+  for (const Keyword &K : Keywords) {
+    T.Slots[keywordSlot(keywordKey(K.Name), KeywordMultiplier)] = K;
+    T.MinLength = K.Name.size() < T.MinLength ? K.Name.size() : T.MinLength;
+    T.MaxLength = K.Name.size() > T.MaxLength ? K.Name.size() : T.MaxLength;
+  }
+  return T;
+}
+
+static constexpr KeywordTable KeywordSlots = buildKeywordTable();
+
+static int identifierToken(std::string_view Ident) {
+  if (Ident.size() < KeywordSlots.MinLength ||
+      Ident.size() > KeywordSlots.MaxLength)
     return tok_identifier;
+  const Keyword &K =
+      KeywordSlots.Slots[keywordSlot(keywordKey(Ident), KeywordMultiplier)];
+  return K.Name == Ident ? K.Tok : tok_identifier;
+}
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+static double lexNumber(const char *Start, const char *End) {
+  // Plain integers, by far the most common, are converted exactly by hand
+  size_t Len = End - Start;
+  if (Len <= 15 && !memchr(Start, '.', Len)) {
+    int64_t Value = 0;
+    for (const char *P = Start; P != End; ++P)
+      Value = Value * 10 + (*P - '0');
+    return (double)Value;
   }
+  // strtod must not read past the token, e.g. into the "e5" of "1e5"
+  std::string NumStr(Start, Len);
+  return strtod(NumStr.c_str(), nullptr);
+}
 
-  // String literal: "..."
-  if (LastChar == '"') {
-    StringValue = "";
-    while ((LastChar = fgetc(InputFile)) != '"' && LastChar != EOF) {
-      if (LastChar == '\\') {
-        LastChar = fgetc(InputFile);
-        switch (LastChar) {
-        case 'n':
-          StringValue += '\n';
-          break;
-        case 't':
-          StringValue += '\t';
-          break;
-        case '\\':
-          StringValue += '\\';
-          break;
-        case '"':
-          StringValue += '"';
-          break;
-        default:
-          StringValue += LastChar;
+// Lex the text from offset From to the end. Returns where lexing stopped:
+// the end of the text or, if more input may follow, the start of a string
+// literal that is still open at the end.
+size_t SourceBuffer::lex(size_t From, bool MoreInput) {
+  const char *Base = begin();
+  const char *End = end();
+  const char *P = Base + From;
+
+  while (true) {
+    // Skip whitespace and comments (# until end of line)
+    while (hasClass(P, CC_Space))
+      ++P;
+    if (*P == '#') {
+      while (!hasClass(P, CC_LineEnd))
+        ++P;
+      continue;
+    }
+    if (*P == '\0' && P == End)
+      return P - Base;
+
+    const char *Start = P;
+    uint32_t Offset = Start - Base;
+
+    // Identifier and keywords
+    if (hasClass(P, CC_IdentStart)) {
+      while (hasClass(++P, CC_IdentBody))
+        ;
+      std::string_view Ident(Start, P - Start);
+      int Kind = identifierToken(Ident);
+      uint32_t Id = Kind == tok_identifier ? Symbol(Ident).id() : 0;
+      Tokens.push_back({Kind, Offset, Id});
+      continue;
+    }
+
+    // String literal: "..."
+    if (*P == '"') {
+      std::string Value;
+      bool Closed = false;
+      ++P;
+      while (true) {
+        const char *Run = P;
+        while (!hasClass(P, CC_StringStop))
+          ++P;
+        Value.append(Run, P - Run);
+        if (*P == '"') {
+          ++P;
+          Closed = true;
           break;
         }
-      } else {
-        StringValue += LastChar;
+        if (*P == '\\') {
+          if (++P == End)
+            continue;
+          switch (*P++) {
+          case 'n':
+            Value += '\n';
+            break;
+          case 't':
+            Value += '\t';
+            break;
+          default:
+            Value += P[-1];
+            break;
+          }
+          continue;
+        }
+        // NUL: the end of the text, or a character of the string
+        if (P == End)
+          break;
+        Value += *P++;
       }
+      if (!Closed && MoreInput)
+        return Offset;
+      Tokens.push_back({tok_string_lit, Offset, (uint32_t)Strings.size()});
+      Strings.push_back(std::move(Value));
+      continue;
     }
-    LastChar = fgetc(InputFile);
-    return tok_string_lit;
-  }
 
-  // Number
-  if (isdigit(LastChar) || LastChar == '.') {
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = fgetc(InputFile);
-    } while (isdigit(LastChar) || LastChar == '.');
-    NumVal = strtod(NumStr.c_str(), nullptr);
-    return tok_number;
-  }
+    // Number
+    if (hasClass(P, CC_NumberBody)) {
+      while (hasClass(++P, CC_NumberBody))
+        ;
+      Tokens.push_back({tok_number, Offset, (uint32_t)Numbers.size()});
+      Numbers.push_back(lexNumber(Start, P));
+      continue;
+    }
 
-  // Arrow: ->
-  if (LastChar == '-') {
-    int NextChar = fgetc(InputFile);
-    if (NextChar == '>') {
-      LastChar = fgetc(InputFile);
-      return tok_arrow;
+    // Operators; the NUL after the text makes P[1] safe to read
+    int Kind = (unsigned char)*P++;
+    switch (Kind) {
+    case '-': // Arrow: ->
+      if (*P == '>') {
+        ++P;
+        Kind = tok_arrow;
+      }
+      break;
+    case ':':
+      Kind = tok_colon;
+      break;
+    case '=': // Equal: ==
+      if (*P == '=') {
+        ++P;
+        Kind = tok_eq;
+      }
+      break;
+    case '!': // Not Equal: !=
+      if (*P == '=') {
+        ++P;
+        Kind = tok_ne;
+      }
+      break;
     }
-    // Not arrow, just minus
-    ungetc(NextChar, InputFile);
-    int ThisChar = LastChar;
-    LastChar = fgetc(InputFile);
-    return ThisChar;
+    Tokens.push_back({Kind, Offset, 0});
   }
+}
 
-  // Colon: :
-  if (LastChar == ':') {
-    LastChar = fgetc(InputFile);
-    return tok_colon;
-  }
+void SourceBuffer::lexAll() {
+  // Tokens average well over four characters with their spacing; pages of
+  // the reservation that go unused are never touched
+  Tokens.reserve((end() - begin()) / 4 + 1);
+  Unlexed = lex(0, false);
+  Tokens.push_back({tok_eof, (uint32_t)Unlexed, 0});
+}
 
-  // Equal: == or =
-  if (LastChar == '=') {
-    int NextChar = fgetc(InputFile);
-    if (NextChar == '=') {
-      LastChar = fgetc(InputFile);
-      return tok_eq;
-    }
-    ungetc(NextChar, InputFile);
-    int ThisChar = LastChar;
-    LastChar = fgetc(InputFile);
-    return ThisChar;
+// Read the next line typed at the terminal and lex it, along with a string
+// literal left open by the lines before. At the end of the input, finish.
+void SourceBuffer::lexLine() {
+  size_t Before = Text.size();
+  int C;
+  while ((C = fgetc(Terminal)) != EOF) {
+    Text += (char)C;
+    if (C == '\n')
+      break;
   }
+  bool AtEnd = Text.size() == Before;
+  Unlexed = lex(Unlexed, !AtEnd);
+  if (AtEnd)
+    Tokens.push_back({tok_eof, (uint32_t)Unlexed, 0});
+}
 
-  if (LastChar == ':') {
-    LastChar = fgetc(InputFile);
-    return tok_colon;
-  }
+static thread_local std::shared_ptr<SourceBuffer> Source;
+// Index of the token after the current one, or of tok_eof once it is reached
+static thread_local size_t NextToken = 0;
 
-  // Not Equal: !=
-  if (LastChar == '!') {
-    int NextChar = fgetc(InputFile);
-    if (NextChar == '=') {
-      LastChar = fgetc(InputFile);
-      return tok_ne;
-    }
-    ungetc(NextChar, InputFile);
-    int ThisChar = LastChar;
-    LastChar = fgetc(InputFile);
-    return ThisChar;
+static void setTokenValues(const SourceBuffer &B, const LexedToken &T) {
+  switch (T.Kind) {
+  case tok_identifier:
+    IdentifierSym = Symbol::fromId(T.Payload);
+    IdentifierStr = IdentifierSym.str();
+    break;
+  case tok_number:
+    NumVal = B.Numbers[T.Payload];
+    break;
+  case tok_string_lit:
+    StringValue = B.Strings[T.Payload];
+    break;
   }
+}
+
+static void setSource(std::shared_ptr<SourceBuffer> Buffer,
+                      const std::string &path) {
+  Buffer->Path = path;
+  if (!Buffer->Terminal)
+    Buffer->lexAll();
+  Source = std::move(Buffer);
+  NextToken = 0;
+}
+
+bool setInputFile(const std::string &path) {
+  auto Buffer = readFile(path);
+  if (!Buffer)
+    return false;
+  setSource(std::move(Buffer), path);
+  return true;
+}
 
-  // Comment: # until end of line
-  if (LastChar == '#') {
-    do
-      LastChar = fgetc(InputFile);
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-    if (LastChar != EOF)
-      return gettok();
+void setInputString(std::string source, const std::string &path) {
+  auto Buffer = std::make_shared<SourceBuffer>();
+  Buffer->Text = std::move(source);
+  setSource(std::move(Buffer), path);
+}
+
+void setInputStream(FILE *file, const std::string &path) {
+  auto Buffer = std::make_shared<SourceBuffer>();
+  if (isatty(fileno(file))) {
+    Buffer->Terminal = file;
+  } else {
+    char Chunk[65536];
+    size_t n;
+    while ((n = fread(Chunk, 1, sizeof(Chunk), file)) > 0)
+      Buffer->Text.append(Chunk, n);
   }
+  setSource(std::move(Buffer), path);
+}
+
+bool isInteractive() { return Source && Source->Terminal; }
+
+const std::string &getInputPath() {
+  static const std::string NoPath;
+  return Source ? Source->Path : NoPath;
+}
 
-  if (LastChar == EOF)
+LexerState saveLexerState() { return {Source, NextToken, CurTok}; }
+
+void restoreLexerState(const LexerState &state) {
+  Source = state.Source;
+  NextToken = state.Index;
+  CurTok = state.CurToken;
+  // The current token is the one before the next, unless it is tok_eof
+  if (Source && NextToken > 0 && CurTok != tok_eof)
+    setTokenValues(*Source, Source->Tokens[NextToken - 1]);
+}
+
+int gettok() {
+  if (!Source)
     return tok_eof;
+  SourceBuffer &B = *Source;
+  // Only a terminal's tokens run out before tok_eof
+  while (NextToken == B.Tokens.size())
+    B.lexLine();
+  const LexedToken &T = B.Tokens[NextToken];
+  if (T.Kind != tok_eof)
+    ++NextToken;
+  setTokenValues(B, T);
+  return T.Kind;
+}
+
+size_t getTokenIndex() {
+  return CurTok == tok_eof ? NextToken : NextToken - 1;
+}
 
-  int ThisChar = LastChar;
-  LastChar = fgetc(InputFile);
-  return ThisChar;
+void seekToken(size_t Index) { NextToken = Index; }
+
+int peekToken(unsigned N) {
+  if (!Source)
+    return tok_eof;
+  SourceBuffer &B = *Source;
+  size_t Index = NextToken + N - 1;
+  while (Index >= B.Tokens.size() && !B.complete())
+    B.lexLine();
+  return Index < B.Tokens.size() ? B.Tokens[Index].Kind : tok_eof;
 }
@@ -1,8 +1,11 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include "Symbol.h"
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <string_view>
 
 //===----------------------------------------------------------------------===//
 // Token Types
@@ -42,6 +45,13 @@ enum Token {
   // New keywords
   tok_static = -29,
   tok_abstract = -30,
+  tok_with = -33,
+  tok_drop = -34,
+  tok_parallel = -35,
+  tok_spawn = -36,
+  tok_reduce = -37,
+  tok_async = -38,
+  tok_await = -39,
 
   // Primary tokens
   tok_identifier = -20,
@@ -55,26 +65,45 @@ enum Token {
   tok_colon = -24, // :
 };
 
-// Global state for the lexer
-extern std::string IdentifierStr;
-extern std::string StringValue;
-extern double NumVal;
-extern FILE *InputFile;
-extern std::string CurrentFilePath;
+// Values of the current token. An identifier is interned as it is lexed;
+// IdentifierStr is the text of IdentifierSym. StringValue points into the
+// lexed input and stays valid while the input is in use.
+extern thread_local Symbol IdentifierSym;
+extern thread_local std::string_view IdentifierStr;
+extern thread_local std::string_view StringValue;
+extern thread_local double NumVal;
 
-// Lexer state structure for save/restore
+struct SourceBuffer;
+
+// Where the lexer is in its input. The input is lexed into tokens up front,
+// so saving and restoring the lexer swaps a buffer and an index.
 struct LexerState {
-  FILE *File;
-  std::string FilePath;
-  int LastChar;
+  std::shared_ptr<SourceBuffer> Source;
+  size_t Index;
   int CurToken;
-  std::string IdentStr;
-  std::string StrVal;
-  double NumValue;
 };
 
 int gettok();
-void setInputFile(FILE *file, const std::string &path);
+// The kind of the Nth token after the current one, without consuming it
+int peekToken(unsigned N = 1);
+// Position of the current token in the input
+size_t getTokenIndex();
+// Continue reading the input at the token at Index
+void seekToken(size_t Index);
+
+// Lex the file at path, which is mapped into memory. Returns false, leaving
+// the input unchanged, if the file cannot be read or is 4 GiB or larger.
+bool setInputFile(const std::string &path);
+// Lex source text that is not in a file
+void setInputString(std::string source, const std::string &path);
+// Lex a stream such as stdin: a terminal is read line by line as the parser
+// asks for tokens, anything else all at once
+void setInputStream(FILE *file, const std::string &path);
+// Whether the input is being typed at a terminal
+bool isInteractive();
+// The path given for the current input, for resolving imports against
+const std::string &getInputPath();
+
 LexerState saveLexerState();
 void restoreLexerState(const LexerState &state);
 
@@ -1,16 +1,32 @@
 #include "ModuleLoader.h"
+#include "BorrowCheck.h"
 #include "CodeGen.h"
+#include "HotReload.h"
 #include "JIT.h"
 #include "Lexer.h"
 #include "Parser.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace llvm;
 using namespace llvm::orc;
 
-std::set<std::string> ImportedModules;
+thread_local std::set<std::string> ImportedModules;
+thread_local bool WatchImports = false;
+
+// Definitions in imported modules that the script cannot reach, as token
+// ranges from an item's first token to the next item's, by module path
+static thread_local std::map<std::string, std::map<size_t, size_t>>
+    DeadDefinitions;
 
 std::string getFileDirectory(const std::string &filepath) {
   std::filesystem::path p(filepath);
@@ -29,75 +45,146 @@ std::string resolvePath(const std::string &basePath,
   return std::filesystem::weakly_canonical(resolved).string();
 }
 
-bool loadModule(const std::string &filename) {
-  // Resolve path relative to current file's directory
-  std::string baseDir = getFileDirectory(CurrentFilePath);
-  std::string fullPath = resolvePath(baseDir, filename);
+namespace {
+// A module file reached through an import, and what compiling it produced
+struct ModuleUnit {
+  std::string Path;
+  LexerState Input;               // Its tokens, from the start
+  std::vector<ModuleUnit *> Deps; // Imports compiled in the same load
+  std::vector<ModuleUnit *> Dependents;
+  size_t Order = 0;     // Position in the graph's topological order
+  bool Scanned = false; // All of its imports have been found
+  bool Missing = false; // The file could not be read
+  const std::map<size_t, size_t> *Dead = nullptr; // Definitions to skip
+  size_t PendingDeps = 0;
 
-  // Check if already imported (circular import prevention)
-  if (ImportedModules.count(fullPath)) {
-    return true;
-  }
+  // Results, added to the importer's state in topological order
+  std::vector<ThreadSafeModule> Modules;
+  DenseMap<Symbol, std::unique_ptr<PrototypeAST>> Protos;
+  DenseMap<Symbol, StructDef> Structs;
+  bool HadErrors = false;
+};
+
+// The modules loaded by a run of imports, each ordered after those it
+// imports
+struct ModuleGraph {
+  std::map<std::string, std::unique_ptr<ModuleUnit>> Units;
+  std::vector<ModuleUnit *> Order;
+};
+
+// The importer's compiler state, which every module starts out from
+struct ImporterState {
+  std::shared_ptr<LLJIT> JIT;
+  const DenseMap<Symbol, std::unique_ptr<PrototypeAST>> &Protos;
+  const DenseMap<Symbol, StructDef> &Structs;
+  const std::map<int, int> &Precedence;
+  bool Reassociate;
+  bool Watch;
+};
+} // namespace
+
+// Lex the module at fullPath and, depth first, the modules it imports that
+// are not loaded yet. An import of a module whose imports are still being
+// scanned closes a cycle and is left out, as loading the modules one by one
+// would skip it as already imported.
+static ModuleUnit *scanModule(ModuleGraph &G, const std::string &fullPath) {
+  auto It = G.Units.find(fullPath);
+  if (It != G.Units.end())
+    return It->second->Scanned ? It->second.get() : nullptr;
+  if (ImportedModules.count(fullPath))
+    return nullptr;
   ImportedModules.insert(fullPath);
 
-  // Save current lexer state BEFORE opening new file
-  LexerState savedState = saveLexerState();
+  auto &Slot = G.Units[fullPath];
+  Slot = std::make_unique<ModuleUnit>();
+  ModuleUnit *U = Slot.get();
+  U->Path = fullPath;
+  // Reported in its turn, after the modules loaded before it
+  U->Missing = !setInputFile(fullPath);
+  if (!U->Missing) {
+    U->Input = saveLexerState();
+    auto DeadIt = DeadDefinitions.find(fullPath);
+    if (DeadIt != DeadDefinitions.end())
+      U->Dead = &DeadIt->second;
 
-  // Open the module file
-  FILE *moduleFile = fopen(fullPath.c_str(), "r");
-  if (!moduleFile) {
-    fprintf(stderr, "Error: Cannot open module '%s'\n", fullPath.c_str());
-    return false;
+    std::vector<std::string> Imports;
+    for (getNextToken(); CurTok != tok_eof; getNextToken()) {
+      if (CurTok == tok_import && peekToken() == tok_string_lit) {
+        getNextToken();
+        Imports.emplace_back(StringValue);
+      }
+    }
+
+    std::string baseDir = getFileDirectory(fullPath);
+    for (const std::string &Import : Imports) {
+      ModuleUnit *Dep = scanModule(G, resolvePath(baseDir, Import));
+      if (Dep && !Dep->Missing &&
+          std::find(U->Deps.begin(), U->Deps.end(), Dep) == U->Deps.end())
+        U->Deps.push_back(Dep);
+    }
   }
+  U->Scanned = true;
+  U->Order = G.Order.size();
+  G.Order.push_back(U);
+  return U;
+}
+
+// Parse and generate code for the definitions of a module, keeping the
+// finished LLVM modules in U for the importer to add to the JIT
+static void compileModuleItems(ModuleUnit &U) {
+  auto FinishModule = [&] {
+    U.Modules.emplace_back(std::move(TheModule),
+                           ThreadSafeContext(std::move(TheContext)));
+    InitializeModuleAndPassManager();
+  };
 
-  // Set up lexer for the new file
-  setInputFile(moduleFile, fullPath);
+  restoreLexerState(U.Input);
   getNextToken(); // Prime the lexer
+  ReloadableDefinitions = WatchImports;
 
   // Parse the module - only process definitions and exports
   while (CurTok != tok_eof) {
+    if (U.Dead) {
+      auto DeadIt = U.Dead->find(getTokenIndex());
+      if (DeadIt != U.Dead->end()) {
+        seekToken(DeadIt->second);
+        getNextToken();
+        continue;
+      }
+    }
+
     switch (CurTok) {
     case ';':
       getNextToken();
       break;
     case tok_export:
       getNextToken(); // eat 'export'
-      if (CurTok == tok_def) {
+      if (CurTok == tok_def || CurTok == tok_async) {
         if (auto FnAST = ParseDefinition()) {
           if (auto *FnIR = FnAST->codegen()) {
-            auto TSCtx =
-                std::make_unique<ThreadSafeContext>(std::move(TheContext));
-            ExitOnErr(TheJIT->addIRModule(
-                ThreadSafeModule(std::move(TheModule), std::move(*TSCtx))));
-            InitializeModuleAndPassManager();
+            FinishModule();
           }
         }
       } else if (CurTok == tok_type || CurTok == tok_struct) {
         HandleStructDef();
       } else {
-        fprintf(stderr,
-                "Error: Expected 'def', 'type', or 'struct' after 'export'\n");
+        LogError("Expected 'def', 'type', or 'struct' after 'export'");
         getNextToken();
       }
       break;
     case tok_def:
+    case tok_async:
       if (auto FnAST = ParseDefinition()) {
         if (auto *FnIR = FnAST->codegen()) {
-          auto TSCtx =
-              std::make_unique<ThreadSafeContext>(std::move(TheContext));
-          ExitOnErr(TheJIT->addIRModule(
-              ThreadSafeModule(std::move(TheModule), std::move(*TSCtx))));
-          InitializeModuleAndPassManager();
+          FinishModule();
         }
       }
       break;
     case tok_import:
+      // Compiled already, as part of the module graph
       getNextToken(); // eat 'import'
-      if (CurTok == tok_string) {
-        std::string nestedModule = StringValue;
+      if (CurTok == tok_string_lit)
         getNextToken(); // eat string
-        loadModule(nestedModule);
-      }
       break;
     case tok_extern:
       if (auto ProtoAST = ParseExtern()) {
@@ -124,13 +211,321 @@ bool loadModule(const std::string &filename) {
       getNextToken();
       break;
     }
+    TheASTArena.reset();
   }
 
-  // Close the module file
-  fclose(moduleFile);
+  // Statics declared after the last definition
+  if (!TheModule->empty() || !TheModule->global_empty())
+    FinishModule();
+  ReloadableDefinitions = false;
+}
 
-  // Restore original lexer state
+// The modules U imports, directly or not, in topological order
+static std::vector<ModuleUnit *> transitiveDeps(ModuleUnit &U) {
+  std::vector<ModuleUnit *> Deps;
+  std::vector<ModuleUnit *> Stack(U.Deps.begin(), U.Deps.end());
+  while (!Stack.empty()) {
+    ModuleUnit *Dep = Stack.back();
+    Stack.pop_back();
+    if (std::find(Deps.begin(), Deps.end(), Dep) != Deps.end())
+      continue;
+    Deps.push_back(Dep);
+    Stack.insert(Stack.end(), Dep->Deps.begin(), Dep->Deps.end());
+  }
+  std::sort(Deps.begin(), Deps.end(),
+            [](ModuleUnit *A, ModuleUnit *B) { return A->Order < B->Order; });
+  return Deps;
+}
+
+// Compile U on this thread, in compiler state made from the importer's and
+// the definitions of the modules U imports. That is all U gets to see, while
+// loading modules one by one showed it everything loaded before it, so
+// errors are only counted here; U is compiled again in its turn if it had
+// any.
+static void compileUnit(const ImporterState &Importer, ModuleUnit &U) {
+  TheJIT = Importer.JIT;
+  AllowReassociation = Importer.Reassociate;
+  WatchImports = Importer.Watch;
+  BinopPrecedence = Importer.Precedence;
+  StructTypes = Importer.Structs;
+  FunctionProtos.clear();
+  for (auto &Entry : Importer.Protos)
+    FunctionProtos[Entry.first] =
+        std::make_unique<PrototypeAST>(*Entry.second);
+  for (ModuleUnit *Dep : transitiveDeps(U)) {
+    for (auto &Entry : Dep->Protos)
+      FunctionProtos[Entry.first] =
+          std::make_unique<PrototypeAST>(*Entry.second);
+    for (auto &Entry : Dep->Structs)
+      StructTypes[Entry.first] = Entry.second;
+  }
+  TheBorrowChecker = BorrowChecker();
+  ErrorCount = 0;
+  InitializeModuleAndPassManager();
+
+  DenseMap<Symbol, PrototypeAST *> SeenProtos;
+  for (auto &Entry : FunctionProtos)
+    SeenProtos[Entry.first] = Entry.second.get();
+  DenseSet<Symbol> SeenStructs;
+  for (auto &Entry : StructTypes)
+    SeenStructs.insert(Entry.first);
+
+  QuietErrors = true;
+  compileModuleItems(U);
+  QuietErrors = false;
+
+  for (auto &Entry : FunctionProtos) {
+    auto Seen = SeenProtos.find(Entry.first);
+    if (Seen == SeenProtos.end() || Seen->second != Entry.second.get())
+      U.Protos[Entry.first] = std::move(Entry.second);
+  }
+  for (auto &Entry : StructTypes)
+    if (!SeenStructs.count(Entry.first))
+      U.Structs[Entry.first] = Entry.second;
+  U.HadErrors = ErrorCount > 0 || TheBorrowChecker.hasErrors();
+
+  // The module must go before its context
+  Builder.reset();
+  TheModule.reset();
+  TheContext.reset();
+}
+
+// Compile the modules of G on a pool of threads, each one as soon as the
+// modules it imports are done
+static void compileGraph(ModuleGraph &G, const ImporterState &Importer) {
+  std::mutex Lock;
+  std::condition_variable Ready;
+  std::deque<ModuleUnit *> Queue;
+  size_t Finished = 0;
+
+  for (ModuleUnit *U : G.Order) {
+    U->PendingDeps = U->Deps.size();
+    for (ModuleUnit *Dep : U->Deps)
+      Dep->Dependents.push_back(U);
+    if (U->Deps.empty())
+      Queue.push_back(U);
+  }
+
+  auto Worker = [&] {
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (true) {
+      Ready.wait(Guard, [&] {
+        return !Queue.empty() || Finished == G.Order.size();
+      });
+      if (Queue.empty())
+        return;
+      ModuleUnit *U = Queue.front();
+      Queue.pop_front();
+      Guard.unlock();
+      if (!U->Missing)
+        compileUnit(Importer, *U);
+      Guard.lock();
+      ++Finished;
+      for (ModuleUnit *Dependent : U->Dependents)
+        if (--Dependent->PendingDeps == 0)
+          Queue.push_back(Dependent);
+      Ready.notify_all();
+    }
+  };
+
+  size_t NumThreads = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), G.Order.size());
+  std::vector<std::thread> Threads;
+  for (size_t i = 0; i < NumThreads; ++i)
+    Threads.emplace_back(Worker);
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+bool loadModules(const std::vector<std::string> &filenames) {
+  // Resolve paths relative to current file's directory
+  std::string baseDir = getFileDirectory(getInputPath());
+
+  // Find the modules and everything they import, then come back to the
+  // importer's input
+  LexerState savedState = saveLexerState();
+  ModuleGraph G;
+  bool Found = true;
+  for (const std::string &filename : filenames) {
+    std::string fullPath = resolvePath(baseDir, filename);
+    // Check if already imported (circular import prevention)
+    if (ImportedModules.count(fullPath))
+      continue;
+    if (scanModule(G, fullPath)->Missing)
+      Found = false;
+  }
   restoreLexerState(savedState);
+  if (G.Order.empty())
+    return true;
 
+  // Modules that do not import each other compile in parallel; their code
+  // is then added in the order loading them one by one would have
+  compileGraph(G, {TheJIT, FunctionProtos, StructTypes, BinopPrecedence,
+                   AllowReassociation, WatchImports});
+  for (ModuleUnit *U : G.Order) {
+    if (U->Missing) {
+      fprintf(stderr, "Error: Cannot open module '%s'\n", U->Path.c_str());
+      continue;
+    }
+    if (U->HadErrors) {
+      // Compile it again with everything loaded before it in view, as one
+      // by one, which also reports its errors
+      U->Modules.clear();
+      compileModuleItems(*U);
+      restoreLexerState(savedState);
+    } else {
+      for (auto &Entry : U->Protos)
+        FunctionProtos[Entry.first] = std::move(Entry.second);
+      for (auto &Entry : U->Structs)
+        StructTypes[Entry.first] = std::move(Entry.second);
+    }
+    for (ThreadSafeModule &M : U->Modules) {
+      if (WatchImports)
+        M.withModuleDo(noteReloadable);
+      ExitOnErr(TheJIT->addIRModule(*CurrentDylib, std::move(M)));
+    }
+  }
+  if (WatchImports) {
+    std::vector<std::string> Paths;
+    for (ModuleUnit *U : G.Order)
+      if (!U->Missing)
+        Paths.push_back(U->Path);
+    watchModules(Paths);
+  }
+  return Found;
+}
+
+bool recompileModule(const std::string &Path,
+                     std::vector<ThreadSafeModule> &Modules) {
+  ModuleUnit U;
+  U.Path = Path;
+  if (!setInputFile(Path))
+    return false;
+  U.Input = saveLexerState();
+  compileModuleItems(U);
+  Modules = std::move(U.Modules);
   return true;
 }
+
+bool loadModule(const std::string &filename) {
+  return loadModules({filename});
+}
+
+namespace {
+// A top-level item of a source file: its tokens, the function, static or
+// struct type it defines, if any, and the identifiers in it
+struct SourceItem {
+  size_t Begin, End;
+  Symbol Name;
+  std::vector<Symbol> Refs;
+};
+} // namespace
+
+// Split the lexer's input into top-level items, the tokens before the first
+// one making an item of their own, and collect its imports. Expressions
+// contain none of the keywords that start an item, so each item runs up to
+// the next.
+static std::vector<SourceItem> scanItems(std::vector<std::string> &Imports) {
+  std::vector<SourceItem> Items;
+  Items.push_back({0, 0, Symbol(), {}});
+  int PrevTok = 0;
+  bool NameNext = false;
+  for (getNextToken(); CurTok != tok_eof; PrevTok = CurTok, getNextToken()) {
+    switch (CurTok) {
+    case tok_def:
+    case tok_async:
+    case tok_export:
+    case tok_import:
+    case tok_extern:
+    case tok_static:
+    case tok_type:
+    case tok_abstract:
+      // export def, async def, abstract type and so on are one item
+      if (PrevTok != tok_export && PrevTok != tok_async &&
+          PrevTok != tok_abstract) {
+        Items.back().End = getTokenIndex();
+        Items.push_back({getTokenIndex(), 0, Symbol(), {}});
+      }
+      NameNext = CurTok == tok_def || CurTok == tok_static ||
+                 CurTok == tok_type;
+      if (CurTok == tok_import && peekToken() == tok_string_lit) {
+        getNextToken();
+        Imports.emplace_back(StringValue);
+      }
+      // An async function returns a Task without naming it, and its drop
+      // function awaits the task if no one else does
+      if (CurTok == tok_async)
+        Items.back().Refs.push_back(Symbol("Task"));
+      break;
+    case tok_spawn:
+      // Likewise spawn makes a Future, which its drop function joins (see
+      // inferResourceType in Parser.cpp)
+      Items.back().Refs.push_back(Symbol("Future"));
+      NameNext = false;
+      break;
+    case tok_identifier:
+      if (NameNext)
+        Items.back().Name = IdentifierSym;
+      else
+        Items.back().Refs.push_back(IdentifierSym);
+      NameNext = false;
+      break;
+    default:
+      NameNext = false;
+      break;
+    }
+  }
+  Items.back().End = getTokenIndex();
+  return Items;
+}
+
+void findDeadDefinitions() {
+  LexerState savedState = saveLexerState();
+  std::vector<std::string> Imports;
+  DenseSet<Symbol> Used;
+  for (const SourceItem &Item : scanItems(Imports))
+    Used.insert(Item.Refs.begin(), Item.Refs.end());
+
+  // Every module the script imports, directly or not
+  std::map<std::string, std::vector<SourceItem>> Modules;
+  std::deque<std::string> Pending;
+  std::string baseDir = getFileDirectory(getInputPath());
+  for (const std::string &Import : Imports)
+    Pending.push_back(resolvePath(baseDir, Import));
+  while (!Pending.empty()) {
+    std::string Path = Pending.front();
+    Pending.pop_front();
+    if (Modules.count(Path) || !setInputFile(Path))
+      continue;
+    std::vector<std::string> Nested;
+    Modules[Path] = scanItems(Nested);
+    for (const std::string &Import : Nested)
+      Pending.push_back(resolvePath(getFileDirectory(Path), Import));
+  }
+  restoreLexerState(savedState);
+
+  // Follow the names the script uses to the definitions of those names,
+  // and on to the names they use
+  DenseMap<Symbol, std::vector<const SourceItem *>> Definitions;
+  for (auto &Module : Modules)
+    for (const SourceItem &Item : Module.second)
+      if (!Item.Name.empty())
+        Definitions[Item.Name].push_back(&Item);
+  std::vector<Symbol> Work(Used.begin(), Used.end());
+  while (!Work.empty()) {
+    Symbol Name = Work.back();
+    Work.pop_back();
+    auto It = Definitions.find(Name);
+    if (It == Definitions.end())
+      continue;
+    for (const SourceItem *Item : It->second)
+      for (Symbol Ref : Item->Refs)
+        if (Used.insert(Ref).second)
+          Work.push_back(Ref);
+  }
+
+  for (auto &Module : Modules)
+    for (const SourceItem &Item : Module.second)
+      if (!Item.Name.empty() && !Used.count(Item.Name))
+        DeadDefinitions[Module.first][Item.Begin] = Item.End;
+}
@@ -1,13 +1,32 @@
 #ifndef MODULELOADER_H
 #define MODULELOADER_H
 
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include <set>
 #include <string>
+#include <vector>
 
 /// Load and parse an imported module file
 /// Returns true if successful
 bool loadModule(const std::string &filename);
 
+/// Load several modules, as if imported one after the other. Modules that
+/// do not import each other are compiled in parallel.
+/// Returns true if all of them could be read
+bool loadModules(const std::vector<std::string> &filenames);
+
+/// Compile the definitions of the module file at Path again, without
+/// loading its imports, into one LLVM module each as when it was first
+/// loaded. Returns false if the file could not be read.
+bool recompileModule(const std::string &Path,
+                     std::vector<llvm::orc::ThreadSafeModule> &Modules);
+
+/// Find the definitions in the modules a script imports that the script
+/// cannot reach, so that loading the modules skips them. The script is the
+/// lexer's input, read from the start. Only for a whole script: at the REPL
+/// or in an Engine, anything may be called later.
+void findDeadDefinitions();
+
 /// Get the directory of the current file being parsed
 std::string getFileDirectory(const std::string &filepath);
 
@@ -16,6 +35,10 @@ std::string resolvePath(const std::string &basePath,
                         const std::string &relativePath);
 
 /// Track which modules have been imported to prevent circular imports
-extern std::set<std::string> ImportedModules;
+extern thread_local std::set<std::string> ImportedModules;
+
+/// Reload imported modules when their files change (--watch, see
+/// HotReload.h)
+extern thread_local bool WatchImports;
 
 #endif // MODULELOADER_H
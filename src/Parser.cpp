@@ -6,21 +6,39 @@
 #include <cstdio>
 
 // Parser state
-int CurTok;
-std::map<int, int> BinopPrecedence;
-std::string CurrentAnonName;
+thread_local int CurTok;
+thread_local std::map<int, int> BinopPrecedence;
+thread_local std::string CurrentAnonName;
 
 // Loop context for break/continue
-std::vector<llvm::BasicBlock *> LoopEndBlocks;
-std::vector<llvm::BasicBlock *> LoopCondBlocks;
+thread_local std::vector<llvm::BasicBlock *> LoopEndBlocks;
+thread_local std::vector<llvm::BasicBlock *> LoopCondBlocks;
+thread_local std::vector<size_t> LoopCleanupDepths;
 
 // Struct type registry
-std::map<std::string, StructDef> StructTypes;
+thread_local DenseMap<Symbol, StructDef> StructTypes;
+
+// Expression nodes of the top-level item being compiled
+thread_local ASTArena TheASTArena;
 
 int getNextToken() { return CurTok = gettok(); }
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+void InitializeBinopPrecedence() {
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['>'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40;
+  BinopPrecedence['/'] = 40;
+  BinopPrecedence[';'] = 1;
+  BinopPrecedence[tok_eq] = 10;
+  BinopPrecedence[tok_ne] = 10;
+}
+
+ExprAST *LogError(const char *Str) {
+  ++ErrorCount;
+  if (!QuietErrors)
+    fprintf(stderr, "Error: %s\n", Str);
   return nullptr;
 }
 
@@ -30,8 +48,7 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
 }
 
 // Forward declarations
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS);
+static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
 
 /// Parse type annotation: int, float, string, bool, or struct name
 TypeInfo ParseType() {
@@ -49,8 +66,14 @@ TypeInfo ParseType() {
     getNextToken();
     return TypeInfo(SpyType::Bool);
   case tok_identifier: {
-    std::string typeName = IdentifierStr;
+    Symbol typeName = IdentifierSym;
     getNextToken();
+    if (typeName.str() == "vec2")
+      return TypeInfo(SpyType::Vec2);
+    if (typeName.str() == "vec4")
+      return TypeInfo(SpyType::Vec4);
+    if (typeName.str() == "vec8")
+      return TypeInfo(SpyType::Vec8);
     return TypeInfo(typeName);
   }
   default:
@@ -58,20 +81,59 @@ TypeInfo ParseType() {
   }
 }
 
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
+//===----------------------------------------------------------------------===//
+// Ownership
+//===----------------------------------------------------------------------===//
+
+/// Drop function of a struct type, or empty if values of it own nothing
+static Symbol getDropFunction(Symbol TypeName) {
+  auto it = StructTypes.find(TypeName);
+  if (it == StructTypes.end())
+    return Symbol();
+  return it->second.DropFn;
+}
+
+/// Resource type produced by an expression: a call to a function declared
+/// to return a droppable struct, a spawned task (a Future, as declared by
+/// lib/parallel.frmt), or a variable that owns a resource
+static Symbol inferResourceType(ExprAST *E) {
+  Symbol TypeName;
+  if (dynamic_cast<SpawnExprAST *>(E)) {
+    TypeName = Symbol("Future");
+  } else if (auto *Call = dynamic_cast<CallExprAST *>(E)) {
+    auto it = FunctionProtos.find(Call->getMangledName());
+    if (it != FunctionProtos.end())
+      TypeName = it->second->getReturnType().StructName;
+  } else if (auto *Var = dynamic_cast<VariableExprAST *>(E)) {
+    TypeName = TheBorrowChecker.getResourceType(Var->getName());
+  }
+  return getDropFunction(TypeName).empty() ? Symbol() : TypeName;
+}
+
+/// Transfer ownership out of a variable expression that owns a resource
+static void moveIfResource(ExprAST *E) {
+  auto *Var = dynamic_cast<VariableExprAST *>(E);
+  if (!Var || TheBorrowChecker.getResourceType(Var->getName()).empty())
+    return;
+  Var->setIsMove();
+  TheBorrowChecker.moveVariable(Var->getName());
+}
+
+static ExprAST *ParseNumberExpr() {
   // All literals are float by default - use type annotations for int
-  auto Result = std::make_unique<NumberExprAST>(NumVal, false);
+  auto *Result = TheASTArena.make<NumberExprAST>(NumVal, false);
   getNextToken();
-  return std::move(Result);
+  return Result;
 }
 
-static std::unique_ptr<ExprAST> ParseStringExpr() {
-  auto Result = std::make_unique<StringExprAST>(StringValue);
+static ExprAST *ParseStringExpr() {
+  auto *Result =
+      TheASTArena.make<StringExprAST>(TheASTArena.copy(StringValue));
   getNextToken();
-  return std::move(Result);
+  return Result;
 }
 
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+static ExprAST *ParseParenExpr() {
   getNextToken(); // eat '('
   auto V = ParseExpression();
   if (!V)
@@ -82,8 +144,8 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+static ExprAST *ParseIdentifierExpr() {
+  Symbol IdName = IdentifierSym;
   getNextToken(); // eat identifier
 
   TheBorrowChecker.checkUse(IdName);
@@ -91,13 +153,13 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   // Check for struct instantiation: Point{...}
   if (CurTok == '{') {
     getNextToken(); // eat '{'
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Fields;
+    SmallVector<FieldInit, 8> Fields;
 
     if (CurTok != '}') {
       while (true) {
         if (CurTok != tok_identifier)
           return LogError("expected field name in struct literal");
-        std::string FieldName = IdentifierStr;
+        Symbol FieldName = IdentifierSym;
         getNextToken();
 
         if (CurTok != tok_colon)
@@ -108,7 +170,7 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
         if (!Val)
           return nullptr;
 
-        Fields.push_back({FieldName, std::move(Val)});
+        Fields.push_back({FieldName, Val});
 
         if (CurTok == '}')
           break;
@@ -118,7 +180,8 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
       }
     }
     getNextToken(); // eat '}'
-    return std::make_unique<StructExprAST>(IdName, std::move(Fields));
+    return TheASTArena.make<StructExprAST>(IdName,
+                                           TheASTArena.copy<FieldInit>(Fields));
   }
 
   // Check for assignment: name = expr
@@ -126,36 +189,41 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     getNextToken(); // eat '='
     if (!TheBorrowChecker.checkAssign(IdName)) {
     }
-    auto Value = ParseExpression();
+    // Like a let initializer, the assigned value ends at ';'
+    auto Value = ParsePrimary();
     if (!Value)
       return nullptr;
-    return std::make_unique<AssignExprAST>(IdName, std::move(Value));
+    Value = ParseBinOpRHS(BinopPrecedence[';'] + 1, Value);
+    if (!Value)
+      return nullptr;
+    moveIfResource(Value);
+    return TheASTArena.make<AssignExprAST>(IdName, Value);
   }
 
   // Check for member access: name.field
   if (CurTok == '.') {
-    std::unique_ptr<ExprAST> Obj = std::make_unique<VariableExprAST>(IdName);
+    ExprAST *Obj = TheASTArena.make<VariableExprAST>(IdName);
     while (CurTok == '.') {
       getNextToken(); // eat '.'
       if (CurTok != tok_identifier)
         return LogError("expected field name after '.'");
-      std::string Member = IdentifierStr;
+      Symbol Member = IdentifierSym;
       getNextToken();
-      Obj = std::make_unique<MemberExprAST>(std::move(Obj), Member);
+      Obj = TheASTArena.make<MemberExprAST>(Obj, Member);
     }
     return Obj;
   }
 
   if (CurTok != '(') // Simple variable ref
-    return std::make_unique<VariableExprAST>(IdName);
+    return TheASTArena.make<VariableExprAST>(IdName);
 
   // Function call
   getNextToken(); // eat '('
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SmallVector<ExprAST *, 8> Args;
   if (CurTok != ')') {
     while (true) {
       if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
+        Args.push_back(Arg);
       else
         return nullptr;
 
@@ -167,11 +235,21 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     }
   }
   getNextToken(); // eat ')'
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+
+  // Arguments are borrowed, except when handed to their own drop function
+  for (ExprAST *Arg : Args) {
+    auto *Var = dynamic_cast<VariableExprAST *>(Arg);
+    if (Var && getDropFunction(TheBorrowChecker.getResourceType(
+                   Var->getName())) == IdName)
+      moveIfResource(Var);
+  }
+
+  return TheASTArena.make<CallExprAST>(IdName,
+                                       TheASTArena.copy<ExprAST *>(Args));
 }
 
 /// Parse let expression: let [mut] name[: type] = init [body]
-std::unique_ptr<ExprAST> ParseLetExpr() {
+ExprAST *ParseLetExpr() {
   getNextToken(); // eat 'let'
 
   Mutability Mut = Mutability::Immutable;
@@ -183,7 +261,7 @@ std::unique_ptr<ExprAST> ParseLetExpr() {
   if (CurTok != tok_identifier)
     return LogError("expected identifier after 'let'");
 
-  std::string Name = IdentifierStr;
+  Symbol Name = IdentifierSym;
   getNextToken();
 
   // Optional type annotation
@@ -197,25 +275,40 @@ std::unique_ptr<ExprAST> ParseLetExpr() {
     return LogError("expected '=' in let expression");
   getNextToken();
 
-  auto Init = ParseExpression();
+  // Stop at ';' so that in "let x = e; rest" the rest is sequenced after
+  // the binding instead of being parsed into the initializer
+  auto Init = ParsePrimary();
+  if (!Init)
+    return nullptr;
+  Init = ParseBinOpRHS(BinopPrecedence[';'] + 1, Init);
   if (!Init)
     return nullptr;
 
-  TheBorrowChecker.declareVariable(Name, Mut == Mutability::Mutable);
-
-  std::unique_ptr<ExprAST> Body = nullptr;
-  if (CurTok == ';' || CurTok == tok_eof || CurTok == tok_def ||
-      CurTok == tok_end || CurTok == tok_else) {
-    return std::make_unique<LetExprAST>(Name, Mut, Type, std::move(Init),
-                                        nullptr);
+  // The binding owns resource values and drops them at scope exit
+  Symbol ResourceType = Type.BaseType == SpyType::Struct
+                            ? Type.StructName
+                            : inferResourceType(Init);
+  Symbol DropFn = getDropFunction(ResourceType);
+  if (DropFn.empty())
+    ResourceType = Symbol();
+  moveIfResource(Init);
+
+  TheBorrowChecker.declareVariable(Name, Mut == Mutability::Mutable,
+                                   ResourceType);
+
+  ExprAST *Body = nullptr;
+  if (CurTok != ';' && CurTok != tok_eof && CurTok != tok_def &&
+      CurTok != tok_async && CurTok != tok_end && CurTok != tok_else) {
+    Body = ParseExpression();
   }
 
-  Body = ParseExpression();
-  return std::make_unique<LetExprAST>(Name, Mut, Type, std::move(Init),
-                                      std::move(Body));
+  auto *Let = TheASTArena.make<LetExprAST>(Name, Mut, Init, Body);
+  if (!DropFn.empty())
+    Let->setDropFunction(DropFn);
+  return Let;
 }
 
-std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprAST *ParseIfExpr() {
   getNextToken(); // eat 'if'
 
   auto Cond = ParseExpression();
@@ -226,31 +319,35 @@ std::unique_ptr<ExprAST> ParseIfExpr() {
     return LogError("expected 'then' after if condition");
   getNextToken();
 
+  // Only one of the branches runs, so a move in one does not affect the
+  // other
+  TheBorrowChecker.beginBranch();
   auto Then = ParseExpression();
   if (!Then)
     return nullptr;
 
-  std::unique_ptr<ExprAST> Else = nullptr;
+  ExprAST *Else = nullptr;
   if (CurTok == tok_else) {
     getNextToken();
+    TheBorrowChecker.nextBranch();
     Else = ParseExpression();
     if (!Else)
       return nullptr;
   } else if (CurTok == tok_end) {
     getNextToken(); // eat end
   }
+  TheBorrowChecker.endBranch();
 
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                     std::move(Else));
+  return TheASTArena.make<IfExprAST>(Cond, Then, Else);
 }
 
-std::unique_ptr<ExprAST> ParseForExpr() {
+ExprAST *ParseForExpr(bool IsParallel) {
   getNextToken(); // eat 'for'
 
   if (CurTok != tok_identifier)
     return LogError("expected identifier after 'for'");
 
-  std::string IdName = IdentifierStr;
+  Symbol IdName = IdentifierSym;
   getNextToken();
 
   if (CurTok != '=')
@@ -269,40 +366,56 @@ std::unique_ptr<ExprAST> ParseForExpr() {
   if (!End)
     return nullptr;
 
-  std::unique_ptr<ExprAST> Step;
+  ExprAST *Step;
   if (CurTok == ',') {
     getNextToken();
     Step = ParseExpression();
     if (!Step)
       return nullptr;
   } else {
-    Step = std::make_unique<NumberExprAST>(1.0);
+    Step = TheASTArena.make<NumberExprAST>(1.0);
   }
 
   if (CurTok != tok_do)
     return LogError("expected 'do' after for loop header");
   getNextToken();
 
-  TheBorrowChecker.enterScope();
+  if (IsParallel)
+    TheBorrowChecker.enterParallel();
+  else
+    TheBorrowChecker.enterLoop();
   TheBorrowChecker.declareVariable(IdName, true);
 
   auto Body = ParseExpression();
   if (!Body)
     return nullptr;
 
-  TheBorrowChecker.exitScope();
+  if (IsParallel)
+    TheBorrowChecker.exitParallel();
+  else
+    TheBorrowChecker.exitLoop();
 
   if (CurTok != tok_end)
     return LogError("expected 'end' after for loop body");
   getNextToken();
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                      std::move(Step), std::move(Body));
+  return TheASTArena.make<ForExprAST>(IdName, Start, End, Step, Body,
+                                      IsParallel);
 }
 
-std::unique_ptr<ExprAST> ParseWhileExpr() {
+/// Parse parallel loop: parallel for i = start, end[, step] do body end
+ExprAST *ParseParallelExpr() {
+  getNextToken(); // eat 'parallel'
+  if (CurTok != tok_for)
+    return LogError("expected 'for' after 'parallel'");
+  return ParseForExpr(/*IsParallel=*/true);
+}
+
+ExprAST *ParseWhileExpr() {
   getNextToken(); // eat 'while'
 
+  // The condition runs before each iteration, so it is in the loop too
+  TheBorrowChecker.enterLoop();
   auto Cond = ParseExpression();
   if (!Cond)
     return nullptr;
@@ -318,22 +431,158 @@ std::unique_ptr<ExprAST> ParseWhileExpr() {
     return nullptr;
 
   TheBorrowChecker.exitScope();
+  TheBorrowChecker.exitLoop();
 
   if (CurTok != tok_end)
     return LogError("expected 'end' after while loop body");
   getNextToken();
 
-  return std::make_unique<WhileExprAST>(std::move(Cond), std::move(Body));
+  return TheASTArena.make<WhileExprAST>(Cond, Body);
 }
 
-std::unique_ptr<ExprAST> ParseBreakExpr() {
+ExprAST *ParseBreakExpr() {
   getNextToken(); // eat 'break'
-  return std::make_unique<BreakExprAST>();
+  return TheASTArena.make<BreakExprAST>();
 }
 
-std::unique_ptr<ExprAST> ParseContinueExpr() {
+ExprAST *ParseContinueExpr() {
   getNextToken(); // eat 'continue'
-  return std::make_unique<ContinueExprAST>();
+  return TheASTArena.make<ContinueExprAST>();
+}
+
+/// Parse task spawn: spawn expr
+ExprAST *ParseSpawnExpr() {
+  getNextToken(); // eat 'spawn'
+
+  // The task runs concurrently with the spawner, so like a parallel loop
+  // body it may only read the variables around it. It ends at ';' like a
+  // let initializer.
+  TheBorrowChecker.enterParallel();
+  auto Body = ParsePrimary();
+  if (Body)
+    Body = ParseBinOpRHS(BinopPrecedence[';'] + 1, Body);
+  TheBorrowChecker.exitParallel();
+  if (!Body)
+    return nullptr;
+
+  return TheASTArena.make<SpawnExprAST>(Body);
+}
+
+/// Parse await: await expr
+ExprAST *ParseAwaitExpr() {
+  getNextToken(); // eat 'await'
+
+  auto Task = ParsePrimary();
+  if (!Task)
+    return nullptr;
+  // A task is awaited once; awaiting it takes it from its owner
+  moveIfResource(Task);
+  return TheASTArena.make<AwaitExprAST>(Task);
+}
+
+/// Parse reduction: reduce(op, i = start, end[, step]) expr
+/// op is a binary operator or min/max and must be associative.
+ExprAST *ParseReduceExpr() {
+  getNextToken(); // eat 'reduce'
+
+  if (CurTok != '(')
+    return LogError("expected '(' after 'reduce'");
+  getNextToken();
+
+  ReduceOp Op;
+  if (CurTok == tok_identifier && IdentifierStr == "min")
+    Op = ReduceOp::Min;
+  else if (CurTok == tok_identifier && IdentifierStr == "max")
+    Op = ReduceOp::Max;
+  else if (CurTok == '+')
+    Op = ReduceOp::Add;
+  else if (CurTok == '*')
+    Op = ReduceOp::Mul;
+  else if (BinopPrecedence[CurTok] > 0)
+    return LogError("reduce needs an associative operator: +, *, min or max");
+  else
+    return LogError("expected operator after 'reduce('");
+  getNextToken();
+
+  if (CurTok != ',')
+    return LogError("expected ',' after reduce operator");
+  getNextToken();
+
+  if (CurTok != tok_identifier)
+    return LogError("expected identifier in reduce range");
+  Symbol IdName = IdentifierSym;
+  getNextToken();
+
+  if (CurTok != '=')
+    return LogError("expected '=' after reduce variable");
+  getNextToken();
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+
+  if (CurTok != ',')
+    return LogError("expected ',' after reduce start value");
+  getNextToken();
+
+  auto End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  ExprAST *Step;
+  if (CurTok == ',') {
+    getNextToken();
+    Step = ParseExpression();
+    if (!Step)
+      return nullptr;
+  } else {
+    Step = TheASTArena.make<NumberExprAST>(1.0);
+  }
+
+  if (CurTok != ')')
+    return LogError("expected ')' after reduce range");
+  getNextToken();
+
+  // Iterations may run concurrently; the body ends at ';' like a let
+  // initializer
+  TheBorrowChecker.enterParallel();
+  TheBorrowChecker.declareVariable(IdName, false);
+  auto Body = ParsePrimary();
+  if (Body)
+    Body = ParseBinOpRHS(BinopPrecedence[';'] + 1, Body);
+  TheBorrowChecker.exitParallel();
+  if (!Body)
+    return nullptr;
+
+  return TheASTArena.make<ReduceExprAST>(Op, IdName, Start, End, Step,
+                                         Body);
+}
+
+/// Parse region block: with arena do body end
+ExprAST *ParseWithExpr() {
+  getNextToken(); // eat 'with'
+
+  if (CurTok != tok_identifier || IdentifierStr != "arena")
+    return LogError("expected 'arena' after 'with'");
+  getNextToken();
+
+  if (CurTok != tok_do)
+    return LogError("expected 'do' after 'with arena'");
+  getNextToken();
+
+  TheBorrowChecker.enterScope();
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  TheBorrowChecker.exitScope();
+
+  if (CurTok != tok_end)
+    return LogError("expected 'end' after with block body");
+  getNextToken();
+
+  return TheASTArena.make<ArenaExprAST>(Body);
 }
 
 /// Parse struct definition: type Name struct ... end
@@ -351,7 +600,7 @@ std::unique_ptr<StructDefAST> ParseStructDef() {
   if (CurTok != tok_identifier)
     return nullptr;
 
-  std::string Name = IdentifierStr;
+  Symbol Name = IdentifierSym;
   getNextToken();
 
   if (CurTok != tok_struct)
@@ -359,11 +608,24 @@ std::unique_ptr<StructDefAST> ParseStructDef() {
   getNextToken();
 
   std::vector<StructField> Fields;
+  Symbol DropFn;
   while (CurTok != tok_end && CurTok != tok_eof) {
+    // drop fn: function releasing owned values of this type
+    if (CurTok == tok_drop) {
+      getNextToken(); // eat 'drop'
+      if (CurTok != tok_identifier) {
+        LogError("expected function name after 'drop'");
+        break;
+      }
+      DropFn = IdentifierSym;
+      getNextToken();
+      continue;
+    }
+
     if (CurTok != tok_identifier)
       break;
 
-    std::string FieldName = IdentifierStr;
+    Symbol FieldName = IdentifierSym;
     getNextToken();
 
     if (CurTok != tok_colon) {
@@ -379,21 +641,28 @@ std::unique_ptr<StructDefAST> ParseStructDef() {
   if (CurTok == tok_end)
     getNextToken();
 
-  return std::make_unique<StructDefAST>(Name, std::move(Fields), IsAbstract);
+  return std::make_unique<StructDefAST>(Name, std::move(Fields), IsAbstract,
+                                        DropFn);
 }
 
 bool ParseImport() {
-  getNextToken(); // eat 'import'
-  if (CurTok != tok_string_lit) {
-    LogError("expected string after 'import'");
-    return false;
-  }
-  std::string filename = StringValue;
-  getNextToken();
-  return loadModule(filename);
+  // Load a run of imports together so their modules compile in parallel.
+  // Looking for more at a terminal would wait for the next line.
+  std::vector<std::string> filenames;
+  do {
+    getNextToken(); // eat 'import'
+    if (CurTok != tok_string_lit) {
+      LogError("expected string after 'import'");
+      return false;
+    }
+    filenames.emplace_back(StringValue);
+    getNextToken();
+  } while (!isInteractive() && CurTok == tok_import &&
+           peekToken() == tok_string_lit);
+  return loadModules(filenames);
 }
 
-std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST *ParsePrimary() {
   switch (CurTok) {
   default:
     return LogError("unknown token when expecting an expression");
@@ -409,12 +678,22 @@ std::unique_ptr<ExprAST> ParsePrimary() {
     return ParseIfExpr();
   case tok_for:
     return ParseForExpr();
+  case tok_parallel:
+    return ParseParallelExpr();
+  case tok_spawn:
+    return ParseSpawnExpr();
+  case tok_reduce:
+    return ParseReduceExpr();
+  case tok_await:
+    return ParseAwaitExpr();
   case tok_while:
     return ParseWhileExpr();
   case tok_break:
     return ParseBreakExpr();
   case tok_continue:
     return ParseContinueExpr();
+  case tok_with:
+    return ParseWithExpr();
   case '(':
     return ParseParenExpr();
   }
@@ -427,8 +706,7 @@ static int GetTokPrecedence() {
   return TokPrec;
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
   while (true) {
     int TokPrec = GetTokPrecedence();
     if (TokPrec < ExprPrec)
@@ -443,26 +721,25 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
 
     int NextPrec = GetTokPrecedence();
     if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+      RHS = ParseBinOpRHS(TokPrec + 1, RHS);
       if (!RHS)
         return nullptr;
     }
-    LHS =
-        std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = TheASTArena.make<BinaryExprAST>(BinOp, LHS, RHS);
   }
 }
 
-std::unique_ptr<ExprAST> ParseExpression() {
+ExprAST *ParseExpression() {
   auto LHS = ParsePrimary();
   if (!LHS)
     return nullptr;
-  return ParseBinOpRHS(0, std::move(LHS));
+  return ParseBinOpRHS(0, LHS);
 }
 
 std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != tok_identifier)
     return LogErrorP("Expected function name in prototype");
-  std::string FnName = IdentifierStr;
+  Symbol FnName = IdentifierSym;
   getNextToken();
 
   if (CurTok != '(')
@@ -472,7 +749,7 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
   getNextToken(); // eat '('
 
   while (CurTok == tok_identifier) {
-    std::string ArgName = IdentifierStr;
+    Symbol ArgName = IdentifierSym;
     getNextToken();
 
     TypeInfo ArgType(SpyType::Float); // Default to float
@@ -504,11 +781,22 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
 }
 
 std::unique_ptr<FunctionAST> ParseDefinition() {
+  bool IsAsync = CurTok == tok_async;
+  if (IsAsync) {
+    getNextToken(); // eat 'async'
+    if (CurTok != tok_def) {
+      LogError("expected 'def' after 'async'");
+      return nullptr;
+    }
+  }
   getNextToken(); // eat 'def'
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
+  if (IsAsync)
+    Proto->setIsAsync();
 
+  BorrowChecker::Depth Outside = TheBorrowChecker.getDepth();
   TheBorrowChecker.enterScope();
 
   for (const auto &Arg : Proto->getArgs()) {
@@ -517,10 +805,12 @@ std::unique_ptr<FunctionAST> ParseDefinition() {
 
   if (auto E = ParseExpression()) {
     TheBorrowChecker.exitScope();
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    E->markReturned();
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
   }
 
-  TheBorrowChecker.exitScope();
+  // The body may have stopped in any number of scopes
+  TheBorrowChecker.unwindTo(Outside);
   return nullptr;
 }
 
@@ -538,7 +828,7 @@ std::unique_ptr<GlobalVarAST> ParseStaticVar() {
     LogError("Expected identifier after static");
     return nullptr;
   }
-  std::string Name = IdentifierStr;
+  Symbol Name = IdentifierSym;
   getNextToken();
 
   TypeInfo Type = TypeInfo(SpyType::Float);
@@ -547,24 +837,28 @@ std::unique_ptr<GlobalVarAST> ParseStaticVar() {
     Type = ParseType();
   }
 
-  std::unique_ptr<ExprAST> Init = nullptr;
+  ExprAST *Init = nullptr;
   if (CurTok == '=') {
     getNextToken();
     Init = ParseExpression();
   } else {
     // Default init to 0
-    Init = std::make_unique<NumberExprAST>(0.0);
+    Init = TheASTArena.make<NumberExprAST>(0.0);
   }
 
-  return std::make_unique<GlobalVarAST>(Name, Type, std::move(Init));
+  return std::make_unique<GlobalVarAST>(Name, Type, Init);
 }
 
 std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
+  BorrowChecker::Depth Outside = TheBorrowChecker.getDepth();
+  auto E = ParseExpression();
+  TheBorrowChecker.unwindTo(Outside); // after an error, scopes may be open
+  if (E) {
+    E->markReturned();
     CurrentAnonName = "anon_expr_" + std::to_string(AnonExprCounter++);
-    auto Proto = std::make_unique<PrototypeAST>(CurrentAnonName,
+    auto Proto = std::make_unique<PrototypeAST>(Symbol(CurrentAnonName),
                                                 std::vector<TypedArg>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
   }
   return nullptr;
 }
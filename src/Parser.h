@@ -7,22 +7,33 @@
 #include <vector>
 
 // Current token being parsed
-extern int CurTok;
-extern std::map<int, int> BinopPrecedence;
+extern thread_local int CurTok;
+
+// Arena the parser allocates expression nodes from. It is reset once each
+// top-level item has been compiled, which releases that item's AST.
+extern thread_local ASTArena TheASTArena;
+extern thread_local std::map<int, int> BinopPrecedence;
 
 // Global to store current anon name for lookup
-extern std::string CurrentAnonName;
+extern thread_local std::string CurrentAnonName;
 
 // Loop context for break/continue
-extern std::vector<llvm::BasicBlock *> LoopEndBlocks;
-extern std::vector<llvm::BasicBlock *> LoopCondBlocks;
+extern thread_local std::vector<llvm::BasicBlock *> LoopEndBlocks;
+extern thread_local std::vector<llvm::BasicBlock *> LoopCondBlocks;
+
+// Cleanup stack depth at each enclosing loop body, so break/continue can
+// run the cleanups of the scopes they jump out of
+extern thread_local std::vector<size_t> LoopCleanupDepths;
 
 // Get the next token
 int getNextToken();
 
+// Install the precedences of the built-in binary operators
+void InitializeBinopPrecedence();
+
 // Parsing functions
-std::unique_ptr<ExprAST> ParseExpression();
-std::unique_ptr<ExprAST> ParsePrimary();
+ExprAST *ParseExpression();
+ExprAST *ParsePrimary();
 std::unique_ptr<PrototypeAST> ParsePrototype();
 std::unique_ptr<FunctionAST> ParseDefinition();
 std::unique_ptr<PrototypeAST> ParseExtern();
@@ -31,12 +42,17 @@ std::unique_ptr<GlobalVarAST>
 ParseStaticVar(); // New parser for static variables
 
 // Control flow parsers
-std::unique_ptr<ExprAST> ParseLetExpr();
-std::unique_ptr<ExprAST> ParseIfExpr();
-std::unique_ptr<ExprAST> ParseForExpr();
-std::unique_ptr<ExprAST> ParseWhileExpr();
-std::unique_ptr<ExprAST> ParseBreakExpr();
-std::unique_ptr<ExprAST> ParseContinueExpr();
+ExprAST *ParseLetExpr();
+ExprAST *ParseIfExpr();
+ExprAST *ParseForExpr(bool IsParallel = false);
+ExprAST *ParseParallelExpr();
+ExprAST *ParseSpawnExpr();
+ExprAST *ParseReduceExpr();
+ExprAST *ParseAwaitExpr();
+ExprAST *ParseWhileExpr();
+ExprAST *ParseBreakExpr();
+ExprAST *ParseContinueExpr();
+ExprAST *ParseWithExpr();
 
 // Type parsers
 TypeInfo ParseType();
@@ -47,7 +63,7 @@ bool ParseImport();
 bool loadModule(const std::string &filename);
 
 // Error handling
-std::unique_ptr<ExprAST> LogError(const char *Str);
+ExprAST *LogError(const char *Str);
 std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
 
 #endif // PARSER_H
@@ -1,128 +1,2027 @@
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <unordered_map>
 #include <vector>
 
-// Simple generic handles for Fermat (double/float based) using raw pointers
-// cast to long We use 'double' in Fermat, so we can cast pointers to uint64_t
-// and back.
+// Simple generic handles for Fermat (double/float based) using raw pointers.
+// Every Fermat value is a double, so runtime objects are handed out as their
+// address converted to a double (exact for user-space pointers, which fit in
+// the 53-bit mantissa) and converted back on the way in.
+
+static double toHandle(void *ptr) { return (double)(uintptr_t)ptr; }
+
+template <typename T> static T *fromHandle(double handle) {
+  return reinterpret_cast<T *>((uintptr_t)handle);
+}
+
+// --- Output buffer ---
+//
+// All printing goes through one buffer that is written to stdout when full,
+// on explicit flush and at exit. Interactive output is flushed per line.
+// Each print call holds Lock, so lines printed from parallel loops do not
+// interleave.
+
+struct OutputBuffer {
+  static constexpr size_t Capacity = 64 * 1024;
+
+  char Data[Capacity];
+  size_t Len = 0;
+  bool Binary = false;    // print/println write raw 8-byte doubles
+  int Interactive = -1;   // stdout is a terminal; checked on first use
+  std::mutex Lock;
+
+  ~OutputBuffer() { flush(); }
+
+  void flush() {
+    if (Len)
+      fwrite(Data, 1, Len, stdout);
+    Len = 0;
+    fflush(stdout);
+  }
+
+  void write(const char *p, size_t n) {
+    if (Len + n > Capacity) {
+      flush();
+      if (n > Capacity) {
+        fwrite(p, 1, n, stdout);
+        return;
+      }
+    }
+    std::memcpy(Data + Len, p, n);
+    Len += n;
+  }
+
+  void put(char c) {
+    if (Len == Capacity)
+      flush();
+    Data[Len++] = c;
+  }
+
+  void endLine() {
+    put('\n');
+    if (Interactive < 0)
+      Interactive = isatty(fileno(stdout));
+    if (Interactive)
+      flush();
+  }
+};
+
+static OutputBuffer Out;
+
+// Shortest text that reads back as the same double. Integral values print
+// without an exponent, e.g. 100000 rather than 1e+05.
+static size_t formatNumber(char *buf, size_t size, double val) {
+  std::to_chars_result r;
+  if (val == std::trunc(val) && std::fabs(val) < 9007199254740992.0 &&
+      !(val == 0 && std::signbit(val)))
+    r = std::to_chars(buf, buf + size, (int64_t)val);
+  else
+    r = std::to_chars(buf, buf + size, val);
+  return (size_t)(r.ptr - buf);
+}
+
+static void printNumber(double val) {
+  if (Out.Binary) {
+    Out.write(reinterpret_cast<const char *>(&val), sizeof(val));
+    return;
+  }
+  char buf[32];
+  Out.write(buf, formatNumber(buf, sizeof(buf), val));
+}
+
+// --- Arena (region) allocator ---
+//
+// A bump allocator that backs every collection created while it is the
+// innermost active region. Individual deallocations are no-ops; the whole
+// region is released at once by fermat_arena_end().
+
+struct Arena {
+  struct Block {
+    Block *Prev;
+    size_t Size;
+  };
+
+  static constexpr size_t MinBlockSize = 64 * 1024;
+
+  Block *Head = nullptr;
+  char *Cur = nullptr;
+  char *End = nullptr;
+
+  void *allocate(size_t size, size_t align) {
+    uintptr_t p = ((uintptr_t)Cur + align - 1) & ~(uintptr_t)(align - 1);
+    if (!Cur || p + size > (uintptr_t)End) {
+      grow(size + align);
+      p = ((uintptr_t)Cur + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    Cur = (char *)(p + size);
+    return (void *)p;
+  }
+
+  void grow(size_t minSize) {
+    // Double the block size each time so large regions need few blocks
+    size_t size = Head ? Head->Size * 2 : MinBlockSize;
+    while (size < minSize + sizeof(Block))
+      size *= 2;
+    Block *B = static_cast<Block *>(std::malloc(size));
+    if (!B)
+      throw std::bad_alloc();
+    B->Prev = Head;
+    B->Size = size;
+    Head = B;
+    Cur = reinterpret_cast<char *>(B + 1);
+    End = reinterpret_cast<char *>(B) + size;
+  }
+
+  void release() {
+    while (Head) {
+      Block *Prev = Head->Prev;
+      std::free(Head);
+      Head = Prev;
+    }
+    Cur = End = nullptr;
+  }
+};
+
+// Innermost region last; collections are created in ArenaStack.back().
+// Each thread has its own regions.
+static thread_local std::vector<Arena *> ArenaStack;
+
+static Arena *currentArena() {
+  return ArenaStack.empty() ? nullptr : ArenaStack.back();
+}
+
+// STL allocator drawing from an Arena, or from the global heap when the
+// arena is null. Containers remember the arena they were created in.
+template <typename T> struct ArenaAllocator {
+  using value_type = T;
+
+  Arena *A = nullptr;
+
+  ArenaAllocator(Arena *a = nullptr) : A(a) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : A(other.A) {}
+
+  T *allocate(size_t n) {
+    if (A)
+      return static_cast<T *>(A->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *ptr, size_t) {
+    if (!A)
+      ::operator delete(ptr);
+  }
+
+  template <typename U> bool operator==(const ArenaAllocator<U> &o) const {
+    return A == o.A;
+  }
+  template <typename U> bool operator!=(const ArenaAllocator<U> &o) const {
+    return A != o.A;
+  }
+};
+
+using FermatList = std::vector<double, ArenaAllocator<double>>;
+using FermatMap =
+    std::map<double, double, std::less<double>,
+             ArenaAllocator<std::pair<const double, double>>>;
+using FermatSet = std::set<double, std::less<double>, ArenaAllocator<double>>;
+
+// Create a collection in the current region (or on the heap outside one)
+template <typename C> static double createCollection() {
+  Arena *A = currentArena();
+  if (!A)
+    return toHandle(new C(typename C::allocator_type()));
+  void *mem = A->allocate(sizeof(C), alignof(C));
+  return toHandle(new (mem) C(typename C::allocator_type(A)));
+}
+
+// Region-owned collections are released with their arena, not one by one
+template <typename C> static void freeCollection(double handle) {
+  C *c = fromHandle<C>(handle);
+  if (c && !c->get_allocator().A)
+    delete c;
+}
+
+// --- Strings ---
+//
+// Immutable byte strings. Up to InlineCapacity bytes are stored inside the
+// object itself, so short strings need a single allocation. Interned
+// strings are unique per content and live for the whole run, which makes
+// their handles usable as map keys and comparable with ==.
+
+struct FermatString {
+  static constexpr uint32_t InlineCapacity = 22;
+
+  enum : uint8_t { Interned = 1, InArena = 2 };
+
+  uint32_t Len = 0;
+  uint32_t Hash = 0; // Cached hash, 0 until first computed
+  uint8_t Flags = 0;
+  union {
+    char Inline[InlineCapacity + 1];
+    char *Heap;
+  };
+
+  FermatString() : Heap(nullptr) {}
+
+  bool isInline() const { return Len <= InlineCapacity; }
+  const char *data() const { return isInline() ? Inline : Heap; }
+  std::string_view view() const { return std::string_view(data(), Len); }
+};
+
+static uint64_t mixHash(uint64_t x) {
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ull;
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ull;
+  x ^= x >> 32;
+  return x;
+}
+
+// Hashes 8 bytes per step instead of one byte at a time
+static uint64_t hashBytes(const char *p, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    std::memcpy(&w, p, 8);
+    h = mixHash(h ^ w);
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, p, n);
+  return mixHash(h ^ tail);
+}
+
+static uint32_t stringHash(FermatString *s) {
+  if (!s->Hash) {
+    uint32_t h = (uint32_t)hashBytes(s->data(), s->Len);
+    s->Hash = h ? h : 1;
+  }
+  return s->Hash;
+}
+
+// Allocate a string in the current region (or on the heap outside one).
+// With null data the bytes are left for the caller to fill in.
+static FermatString *makeString(const char *data, size_t len,
+                                bool useArena = true) {
+  Arena *A = useArena ? currentArena() : nullptr;
+  void *mem = A ? A->allocate(sizeof(FermatString), alignof(FermatString))
+                : ::operator new(sizeof(FermatString));
+  FermatString *s = new (mem) FermatString();
+  s->Len = (uint32_t)len;
+  if (A)
+    s->Flags |= FermatString::InArena;
+
+  char *dst = s->Inline;
+  if (!s->isInline()) {
+    dst = A ? static_cast<char *>(A->allocate(len + 1, 1))
+            : static_cast<char *>(std::malloc(len + 1));
+    s->Heap = dst;
+  }
+  if (data && len)
+    std::memcpy(dst, data, len);
+  dst[len] = '\0';
+  return s;
+}
+
+static void freeString(FermatString *s) {
+  if (!s || (s->Flags & (FermatString::Interned | FermatString::InArena)))
+    return;
+  if (!s->isInline())
+    std::free(s->Heap);
+  delete s;
+}
+
+struct StringViewHash {
+  size_t operator()(std::string_view sv) const {
+    return (size_t)hashBytes(sv.data(), sv.size());
+  }
+};
+
+// Interned strings by content; keys view the interned string's own bytes
+static std::unordered_map<std::string_view, FermatString *, StringViewHash>
+    InternTable;
+static std::mutex InternLock;
+
+static FermatString *internString(const char *data, size_t len) {
+  std::lock_guard<std::mutex> Guard(InternLock);
+  auto it = InternTable.find(std::string_view(data, len));
+  if (it != InternTable.end())
+    return it->second;
+  FermatString *s = makeString(data, len, /*useArena=*/false);
+  s->Flags |= FermatString::Interned;
+  InternTable.emplace(s->view(), s);
+  return s;
+}
+
+static bool stringsEqual(FermatString *a, FermatString *b) {
+  if (a == b)
+    return true;
+  if (!a || !b || a->Len != b->Len)
+    return false;
+  // Distinct interned strings always differ
+  if ((a->Flags & b->Flags & FermatString::Interned) ||
+      (a->Hash && b->Hash && a->Hash != b->Hash))
+    return false;
+  return std::memcmp(a->data(), b->data(), a->Len) == 0;
+}
+
+static std::string_view stringView(double handle) {
+  FermatString *s = fromHandle<FermatString>(handle);
+  return s ? s->view() : std::string_view();
+}
+
+// Append-only buffer for building a string in O(total length)
+struct StringBuilder {
+  std::string Buf;
+};
+
+// --- CSV reader ---
+//
+// Delimited numeric files are memory-mapped and parsed in place into one
+// list per column. A streaming table maps one window of the file at a time
+// and refills its columns chunk by chunk, for files larger than memory.
+
+static const double PowersOf10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                    1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                    1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Parse a decimal number from [p, end) into *out and return the position
+// after it. Up to 15 significant digits with a decimal exponent within 22
+// are exact with a single multiply or divide (Clinger's fast path); any
+// other input is handed to strtod. Returns p when there is no number.
+static const char *parseNumber(const char *p, const char *end, double *out) {
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+
+  uint64_t mantissa = 0;
+  int digits = 0, exp10 = 0;
+  bool sawDigit = false;
+  for (; p < end && (unsigned)(*p - '0') < 10; ++p, sawDigit = true) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+      if (mantissa)
+        ++digits;
+    } else {
+      ++exp10; // Dropped digits only matter on the slow path
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && (unsigned)(*p - '0') < 10; ++p, sawDigit = true) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        if (mantissa)
+          ++digits;
+        --exp10;
+      }
+    }
+  }
+  if (sawDigit && p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool expNegative = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      expNegative = *q++ == '-';
+    if (q < end && (unsigned)(*q - '0') < 10) {
+      int e = 0;
+      for (; q < end && (unsigned)(*q - '0') < 10; ++q)
+        e = e < 10000 ? e * 10 + (*q - '0') : e;
+      exp10 += expNegative ? -e : e;
+      p = q;
+    }
+  }
+
+  if (sawDigit && digits <= 15 && exp10 >= -22 && exp10 <= 22) {
+    double v = (double)mantissa;
+    v = exp10 < 0 ? v / PowersOf10[-exp10] : v * PowersOf10[exp10];
+    *out = negative ? -v : v;
+    return p;
+  }
+
+  // Slow path: too many digits, a huge exponent, or inf/nan
+  char buf[128];
+  size_t n = std::min((size_t)(end - start), sizeof(buf) - 1);
+  std::memcpy(buf, start, n);
+  buf[n] = '\0';
+  char *stop = nullptr;
+  *out = strtod(buf, &stop);
+  return start + (stop - buf);
+}
+
+struct CsvTable {
+  std::vector<FermatList *> Columns;
+  size_t Rows = 0;
+  char Delim = ',';
+  bool HeaderPending = false;
+
+  // Streaming state: open file and the offset of the next unparsed byte
+  int Fd = -1;
+  size_t FileSize = 0;
+  size_t Offset = 0;
+
+  ~CsvTable() {
+    for (FermatList *col : Columns)
+      delete col;
+    if (Fd >= 0)
+      close(Fd);
+  }
+
+  void parseLine(const char *p, const char *end) {
+    if (end > p && end[-1] == '\r')
+      --end;
+    if (p == end)
+      return; // Blank line
+    if (HeaderPending) {
+      HeaderPending = false;
+      if (Columns.empty())
+        addColumns(p, end);
+      return;
+    }
+    if (Columns.empty())
+      addColumns(p, end);
+
+    size_t col = 0;
+    while (col < Columns.size()) {
+      while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+      double v = NAN; // Empty or non-numeric field
+      const char *q = parseNumber(p, end, &v);
+      if (q == p)
+        v = NAN;
+      Columns[col++]->push_back(v);
+
+      const char *next = static_cast<const char *>(
+          std::memchr(q, Delim, (size_t)(end - q)));
+      if (!next)
+        break;
+      p = next + 1;
+    }
+    // Short rows are padded so every column has one value per row
+    for (; col < Columns.size(); ++col)
+      Columns[col]->push_back(NAN);
+    ++Rows;
+  }
+
+  // Parse complete lines from [p, end), at most maxRows of them, and
+  // return the position after the last one parsed. A final line without a
+  // newline is only complete at end of file.
+  const char *parseRows(const char *p, const char *end, bool atEof,
+                        size_t maxRows) {
+    size_t first = Rows;
+    while (Rows - first < maxRows && p < end) {
+      const char *eol =
+          static_cast<const char *>(std::memchr(p, '\n', (size_t)(end - p)));
+      if (!eol) {
+        if (!atEof)
+          break;
+        eol = end;
+      }
+      parseLine(p, eol);
+      p = eol < end ? eol + 1 : end;
+    }
+    return p;
+  }
+
+  void addColumns(const char *p, const char *end) {
+    size_t n = 1 + (size_t)std::count(p, end, Delim);
+    for (size_t i = 0; i < n; ++i)
+      Columns.push_back(new FermatList());
+  }
+
+  void reserve(size_t rows) {
+    for (FermatList *col : Columns)
+      col->reserve(rows);
+  }
+};
+
+static int openCsv(double path, size_t *size) {
+  FermatString *s = fromHandle<FermatString>(path);
+  if (!s)
+    return -1;
+  int fd = open(s->data(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Cannot open '%s'\n", s->data());
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  // A directory opens too, but cannot be mapped or read
+  if (!S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Error: Cannot read '%s': not a file\n", s->data());
+    close(fd);
+    return -1;
+  }
+  *size = (size_t)st.st_size;
+  return fd;
+}
+
+static char csvDelimiter(double delim) {
+  std::string_view sv = stringView(delim);
+  return sv.empty() ? ',' : sv[0];
+}
+
+// --- Parallel loops and tasks ---
+//
+// Codegen outlines the body of a parallel for into a function that runs the
+// iterations [lo, hi), and a spawned expression into a function computing
+// its value. Both are scheduled on a work-stealing pool. A thread splits
+// the loop range it takes in halves, keeping the lower half and pushing the
+// upper one onto its own deque; spawned tasks are pushed there too. Idle
+// threads steal the oldest (largest) pieces. A thread waiting for a loop
+// or a future to finish runs pool work meanwhile instead of blocking.
+
+using ChunkFn = void (*)(int64_t lo, int64_t hi, void *env);
+using PartialFn = double (*)(int64_t lo, int64_t hi, void *env);
+using TaskFn = double (*)(void *env);
+
+// Operators of reduce expressions, numbered as ReduceOp in AST.h
+enum ReduceOpCode { ReduceAdd, ReduceMul, ReduceMin, ReduceMax };
+
+static double reduceIdentity(int Op) {
+  switch (Op) {
+  case ReduceMul:
+    return 1.0;
+  case ReduceMin:
+    return HUGE_VAL;
+  case ReduceMax:
+    return -HUGE_VAL;
+  default:
+    return 0.0;
+  }
+}
+
+static double reduceCombine(int Op, double a, double b) {
+  switch (Op) {
+  case ReduceMul:
+    return a * b;
+  case ReduceMin:
+    return std::fmin(a, b);
+  case ReduceMax:
+    return std::fmax(a, b);
+  default:
+    return a + b;
+  }
+}
+
+// One worker's running result of a reduction, padded to a cache line so
+// workers updating their own partials do not contend
+struct alignas(64) ReducePartial {
+  double Value;
+};
+
+struct ParallelJob {
+  ChunkFn Body = nullptr;
+  PartialFn Partial = nullptr;         // Reductions run this instead of Body
+  int Op = ReduceAdd;                  // and combine results with Op
+  std::vector<ReducePartial> Partials; // One per pool thread
+  std::mutex OutsideLock; // Threads outside the pool share partial 0
+  void *Env;
+  int64_t Grain;                  // Ranges this small are not split further
+  std::atomic<int64_t> Remaining; // Iterations not yet finished
+
+  ParallelJob(void *Env, int64_t Grain, int64_t N)
+      : Env(Env), Grain(Grain), Remaining(N) {}
+};
+
+// Result of a spawned task
+struct FermatFuture {
+  TaskFn Fn = nullptr;
+  void *Env = nullptr; // Copy of the spawner's captured values
+  double Result = 0.0;
+  std::atomic<bool> Done{false};
+};
+
+// A range of a parallel loop, or a spawned task when Future is set
+struct ParallelTask {
+  ParallelJob *Job;
+  int64_t Lo, Hi;
+  FermatFuture *Future = nullptr;
+};
+
+// The owning thread pushes and pops at the back, thieves take the front
+struct WorkQueue {
+  std::mutex Lock;
+  std::deque<ParallelTask> Tasks;
+
+  void push(const ParallelTask &T) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Tasks.push_back(T);
+  }
+
+  bool pop(ParallelTask &T) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Tasks.empty())
+      return false;
+    T = Tasks.back();
+    Tasks.pop_back();
+    return true;
+  }
+
+  bool steal(ParallelTask &T) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Tasks.empty())
+      return false;
+    T = Tasks.front();
+    Tasks.pop_front();
+    return true;
+  }
+};
+
+// Queue slot of the current thread; 0 for threads outside the pool, such
+// as the main thread or the threads of a host running several Engines
+static thread_local size_t WorkerIndex = 0;
+
+struct ThreadPool {
+  size_t NumThreads;
+  std::vector<WorkQueue> Queues;
+  std::atomic<int> ActiveJobs{0};
+  std::atomic<size_t> Blocked{0}; // Threads waiting on a channel or queue
+  std::atomic<size_t> Helpers{0};
+  std::mutex SleepLock;
+  std::condition_variable Wake;
+
+  // Workers live for the rest of the process
+  explicit ThreadPool(size_t N) : NumThreads(N), Queues(N) {
+    for (size_t i = 1; i < N; ++i)
+      std::thread(&ThreadPool::workerLoop, this, i).detach();
+  }
+
+  bool findTask(size_t Self, ParallelTask &T) {
+    if (Queues[Self].pop(T))
+      return true;
+    // Visit victims from a random start so thieves spread out
+    static thread_local uint32_t Seed = 2463534242u + (uint32_t)Self;
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    for (size_t i = 0; i < NumThreads; ++i) {
+      size_t Victim = (Seed + i) % NumThreads;
+      if (Victim != Self && Queues[Victim].steal(T))
+        return true;
+    }
+    return false;
+  }
+
+  // Keeps idle workers awake while loops or tasks are outstanding
+  void beginJob() {
+    if (ActiveJobs.fetch_add(1) == 0) {
+      std::lock_guard<std::mutex> Guard(SleepLock);
+      Wake.notify_all();
+    }
+  }
+  void endJob() { ActiveJobs.fetch_sub(1); }
+
+  void run(size_t Self, ParallelTask T) {
+    if (FermatFuture *F = T.Future) {
+      F->Result = F->Fn(F->Env);
+      endJob();
+      // Last use of F: the joiner frees it once this is set
+      F->Done.store(true, std::memory_order_release);
+      return;
+    }
+
+    ParallelJob *Job = T.Job;
+    while (T.Hi - T.Lo > Job->Grain) {
+      int64_t Mid = T.Lo + (T.Hi - T.Lo) / 2;
+      Queues[Self].push({Job, Mid, T.Hi});
+      T.Hi = Mid;
+    }
+    if (Job->Partial) {
+      double Value = Job->Partial(T.Lo, T.Hi, Job->Env);
+      std::unique_lock<std::mutex> Guard(Job->OutsideLock, std::defer_lock);
+      if (Self == 0)
+        Guard.lock();
+      double &Acc = Job->Partials[Self].Value;
+      Acc = reduceCombine(Job->Op, Acc, Value);
+    } else {
+      Job->Body(T.Lo, T.Hi, Job->Env);
+    }
+    // Last use of Job: the owner may return as soon as this reaches zero
+    Job->Remaining.fetch_sub(T.Hi - T.Lo, std::memory_order_acq_rel);
+  }
+
+  void workerLoop(size_t Self) {
+    WorkerIndex = Self;
+    ParallelTask T;
+    while (true) {
+      if (findTask(Self, T)) {
+        run(Self, T);
+      } else if (ActiveJobs.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> Guard(SleepLock);
+        Wake.wait(Guard, [this] { return ActiveJobs.load() > 0; });
+      }
+    }
+  }
+
+  // Small enough ranges that every thread gets several to balance load,
+  // while keeping per-range overhead negligible
+  int64_t grainFor(int64_t N) const {
+    return std::max<int64_t>(
+        1, std::min<int64_t>(2048, N / (int64_t)(8 * NumThreads)));
+  }
+
+  // Run iterations [0, N) of Job and return when all have finished
+  void runJob(ParallelJob &Job, int64_t N) {
+    beginJob();
+    run(WorkerIndex, {&Job, 0, N});
+    helpUntil(
+        [&] { return Job.Remaining.load(std::memory_order_acquire) == 0; });
+    endJob();
+  }
+
+  void spawn(FermatFuture *F) {
+    beginJob();
+    Queues[WorkerIndex].push({nullptr, 0, 0, F});
+  }
+
+  bool hasQueuedTasks() {
+    for (WorkQueue &Q : Queues) {
+      std::lock_guard<std::mutex> Guard(Q.Lock);
+      if (!Q.Tasks.empty())
+        return true;
+    }
+    return false;
+  }
+
+  // Called by a thread waiting on a channel or queue, counted in Blocked.
+  // When as many threads wait as there are workers and helpers, queued
+  // tasks may be what the waiters wait for, such as the producer of a
+  // channel spawned by its consumer on a single thread, so a helper thread
+  // starts to run them.
+  void beforeWait() {
+    if (Blocked.load() < NumThreads - 1 + Helpers.load() ||
+        !hasQueuedTasks())
+      return;
+    Helpers.fetch_add(1);
+    std::thread([this] {
+      ParallelTask T;
+      while (findTask(0, T))
+        run(0, T);
+      Helpers.fetch_sub(1);
+    }).detach();
+  }
+
+  // Yield the thread until Try succeeds, as a waiting thread
+  template <typename TryFn> void waitUntil(TryFn Try) {
+    if (Try())
+      return;
+    Blocked.fetch_add(1);
+    while (!Try()) {
+      beforeWait();
+      std::this_thread::yield();
+    }
+    Blocked.fetch_sub(1);
+  }
+
+  // Run pool work until Finished() holds. Usually the first task found is
+  // the awaited one itself, unless another thread stole it.
+  template <typename Pred> void helpUntil(Pred Finished) {
+    size_t Self = WorkerIndex;
+    ParallelTask T;
+    while (!Finished()) {
+      if (findTask(Self, T))
+        run(Self, T);
+      else
+        std::this_thread::yield();
+    }
+  }
+};
+
+// Started on first use with FERMAT_THREADS threads, or one per core
+static ThreadPool *getThreadPool() {
+  static ThreadPool *Pool = [] {
+    size_t N = std::thread::hardware_concurrency();
+    if (const char *Env = getenv("FERMAT_THREADS"))
+      N = (size_t)atoi(Env);
+    return new ThreadPool(std::max<size_t>(N, 1));
+  }();
+  return Pool;
+}
+
+// --- Concurrent collections ---
+//
+// Shared by threads of parallel loops and tasks, unlike the collections
+// above. They always live on the heap, outside any region.
+
+// Hash map split into shards with a lock each, so threads updating
+// different keys rarely wait for each other
+struct ConcurrentMap {
+  static constexpr size_t NumShards = 64;
+
+  struct alignas(64) Shard {
+    std::mutex Lock;
+    std::unordered_map<double, double> Map;
+  };
+  Shard Shards[NumShards];
+
+  Shard &shardFor(double Key) {
+    if (Key == 0)
+      Key = 0.0; // -0.0 is the same key
+    uint64_t Bits;
+    std::memcpy(&Bits, &Key, sizeof(Bits));
+    return Shards[mixHash(Bits) % NumShards];
+  }
+};
+
+// Bounded multi-producer multi-consumer ring (Vyukov). Each cell's
+// sequence number says whose turn it is: a producer may fill the cell at
+// position pos when it equals pos, a consumer may empty it when it equals
+// pos + 1. Both sides claim positions with one compare-and-swap.
+struct ConcurrentQueue {
+  struct Cell {
+    std::atomic<size_t> Sequence;
+    double Value;
+  };
+
+  std::unique_ptr<Cell[]> Cells;
+  size_t Mask;
+  alignas(64) std::atomic<size_t> EnqueuePos{0};
+  alignas(64) std::atomic<size_t> DequeuePos{0};
+
+  explicit ConcurrentQueue(size_t Capacity) {
+    size_t N = 2;
+    while (N < Capacity)
+      N <<= 1;
+    Cells.reset(new Cell[N]);
+    Mask = N - 1;
+    for (size_t i = 0; i < N; ++i)
+      Cells[i].Sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool tryPush(double V) {
+    size_t Pos = EnqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &C = Cells[Pos & Mask];
+      size_t Seq = C.Sequence.load(std::memory_order_acquire);
+      intptr_t Diff = (intptr_t)Seq - (intptr_t)Pos;
+      if (Diff == 0) {
+        if (EnqueuePos.compare_exchange_weak(Pos, Pos + 1,
+                                             std::memory_order_relaxed)) {
+          C.Value = V;
+          C.Sequence.store(Pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (Diff < 0) {
+        return false; // Full
+      } else {
+        Pos = EnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(double &V) {
+    size_t Pos = DequeuePos.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &C = Cells[Pos & Mask];
+      size_t Seq = C.Sequence.load(std::memory_order_acquire);
+      intptr_t Diff = (intptr_t)Seq - (intptr_t)(Pos + 1);
+      if (Diff == 0) {
+        if (DequeuePos.compare_exchange_weak(Pos, Pos + 1,
+                                             std::memory_order_relaxed)) {
+          V = C.Value;
+          C.Sequence.store(Pos + Mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (Diff < 0) {
+        return false; // Empty
+      } else {
+        Pos = DequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t size() const {
+    size_t Head = DequeuePos.load(std::memory_order_relaxed);
+    size_t Tail = EnqueuePos.load(std::memory_order_relaxed);
+    return Tail > Head ? Tail - Head : 0;
+  }
+};
+
+// Sleep while Word holds Expected, and wake sleepers after changing Word.
+// Waits may also end early, so callers check their condition again.
+static void futexWait(std::atomic<uint32_t> &Word, uint32_t Expected) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&Word), FUTEX_WAIT_PRIVATE,
+          Expected, nullptr, nullptr, 0);
+#else
+  while (Word.load() == Expected)
+    std::this_thread::yield();
+#endif
+}
+
+static void futexWake(std::atomic<uint32_t> &Word, int Count) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&Word), FUTEX_WAKE_PRIVATE,
+          Count, nullptr, nullptr, 0);
+#else
+  (void)Word;
+  (void)Count;
+#endif
+}
+
+// Bounded channel: a ConcurrentQueue whose blocked senders and receivers
+// sleep in the kernel instead of spinning. Every push bumps Pushes and
+// every pop bumps Pops; a receiver with nothing to take sleeps on Pushes,
+// a sender with no room on Pops. A side only makes the wake-up system call
+// when someone is registered as sleeping on the counter it bumped.
+struct Channel {
+  ConcurrentQueue Queue;
+  alignas(64) std::atomic<uint32_t> Pushes{0};
+  std::atomic<uint32_t> Receivers{0}; // Sleeping on Pushes
+  alignas(64) std::atomic<uint32_t> Pops{0};
+  std::atomic<uint32_t> Senders{0}; // Sleeping on Pops
+  std::atomic<bool> Closed{false};
+
+  explicit Channel(size_t Capacity) : Queue(Capacity) {}
+
+  // Retry until Try succeeds or the channel is closed. The counter is read
+  // before the last attempt, so a pop or push landing after that attempt
+  // changes it and the wait returns at once.
+  template <typename TryFn>
+  bool waitFor(TryFn Try, std::atomic<uint32_t> &Counter,
+               std::atomic<uint32_t> &Sleepers) {
+    while (true) {
+      if (Try())
+        return true;
+      uint32_t Seen = Counter.load();
+      Sleepers.fetch_add(1);
+      bool Done = Try();
+      if (!Done && !Closed.load()) {
+        ThreadPool *Pool = getThreadPool();
+        Pool->Blocked.fetch_add(1);
+        Pool->beforeWait();
+        futexWait(Counter, Seen);
+        Pool->Blocked.fetch_sub(1);
+      }
+      Sleepers.fetch_sub(1);
+      if (Done)
+        return true;
+      if (Closed.load())
+        return false;
+    }
+  }
+
+  void bump(std::atomic<uint32_t> &Counter, std::atomic<uint32_t> &Sleepers) {
+    Counter.fetch_add(1);
+    if (Sleepers.load() > 0)
+      futexWake(Counter, 1);
+  }
+
+  bool send(double V) {
+    if (Closed.load())
+      return false;
+    if (!waitFor([&] { return Queue.tryPush(V); }, Pops, Senders))
+      return false;
+    bump(Pushes, Receivers);
+    return true;
+  }
+
+  // False once the channel is closed and drained. Values sent before the
+  // close are still in the queue for the last attempt.
+  bool recv(double &V) {
+    if (!waitFor([&] { return Queue.tryPop(V); }, Pushes, Receivers) &&
+        !Queue.tryPop(V))
+      return false;
+    bump(Pops, Senders);
+    return true;
+  }
+
+  void close() {
+    Closed.store(true);
+    Pushes.fetch_add(1);
+    Pops.fetch_add(1);
+    futexWake(Pushes, INT32_MAX);
+    futexWake(Pops, INT32_MAX);
+  }
+};
+
+// --- Async tasks and the event loop ---
+//
+// Async functions are compiled to switch-resumed LLVM coroutines. Calling
+// one runs its body up to the first await of an unfinished task and returns
+// a task for its result; the rest runs when the event loop resumes the
+// coroutine. I/O operations return tasks completed by the loop.
+//
+// Each thread has its own loop, driven by awaits outside async functions:
+// those resume ready coroutines and otherwise sleep in poll() on command
+// pipes, timers and a wake-up pipe. Regular files are always "ready" for
+// poll, so file reads and writes run on a helper I/O thread, which reports
+// completions through the wake-up pipe. A task must be awaited on the
+// thread that created it.
+
+// A task is awaited once; the awaiter frees it
+struct FermatTask {
+  bool Done = false;
+  double Result = 0.0;
+  void *Waiter = nullptr; // Coroutine suspended in await of this task
+};
+
+// Switch-lowered coroutine frames start with their resume function
+using ResumeFn = void (*)(void *frame);
+
+static void resumeCoroutine(void *Frame) {
+  (*static_cast<ResumeFn *>(Frame))(Frame);
+}
+
+// Output of a command started by fermat_async_exec, read as it arrives
+struct PipeRead {
+  FILE *Proc;
+  int Fd;
+  std::string Data;
+  FermatTask *Task;
+};
+
+using TimePoint = std::chrono::steady_clock::time_point;
+
+struct EventLoop {
+  std::deque<void *> Ready; // Coroutines whose awaited task is done
+  std::vector<PipeRead> Pipes;
+  std::multimap<TimePoint, FermatTask *> Timers;
+
+  // Completions posted by the I/O thread
+  std::mutex Lock;
+  std::vector<std::pair<FermatTask *, double>> Completed;
+  size_t PendingFileOps = 0;
+  int Wake[2];
+
+  EventLoop() {
+    if (pipe(Wake) != 0)
+      perror("pipe");
+    for (int Fd : Wake)
+      fcntl(Fd, F_SETFL, fcntl(Fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  void complete(FermatTask *T, double Result) {
+    T->Result = Result;
+    T->Done = true;
+    if (T->Waiter)
+      Ready.push_back(T->Waiter);
+    T->Waiter = nullptr;
+  }
+
+  // Called from the I/O thread
+  void post(FermatTask *T, double Result) {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Completed.push_back({T, Result});
+    }
+    char Byte = 0;
+    (void)!write(Wake[1], &Byte, 1);
+  }
+
+  bool idle() const {
+    return Ready.empty() && Pipes.empty() && Timers.empty() &&
+           PendingFileOps == 0;
+  }
+
+  // Returns false when the pipe has reached end of file
+  bool readPipe(PipeRead &P) {
+    char Buf[4096];
+    while (true) {
+      ssize_t n = read(P.Fd, Buf, sizeof(Buf));
+      if (n > 0) {
+        P.Data.append(Buf, (size_t)n);
+        continue;
+      }
+      return n < 0 && (errno == EAGAIN || errno == EINTR);
+    }
+  }
+
+  // Resume one ready coroutine, or wait for and handle I/O events
+  void runOnce() {
+    if (!Ready.empty()) {
+      void *Frame = Ready.front();
+      Ready.pop_front();
+      resumeCoroutine(Frame);
+      return;
+    }
+
+    std::vector<pollfd> Fds;
+    Fds.push_back({Wake[0], POLLIN, 0});
+    for (PipeRead &P : Pipes)
+      Fds.push_back({P.Fd, POLLIN, 0});
+    int Timeout = -1;
+    if (!Timers.empty()) {
+      auto Wait = Timers.begin()->first - std::chrono::steady_clock::now();
+      auto Ms = std::chrono::ceil<std::chrono::milliseconds>(Wait).count();
+      Timeout = (int)std::max<int64_t>(Ms, 0);
+    }
+    if (poll(Fds.data(), Fds.size(), Timeout) < 0)
+      return; // Interrupted; the caller tries again
+
+    if (Fds[0].revents) {
+      char Buf[64];
+      while (read(Wake[0], Buf, sizeof(Buf)) > 0) {
+      }
+      std::vector<std::pair<FermatTask *, double>> Done;
+      {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Done.swap(Completed);
+      }
+      PendingFileOps -= Done.size();
+      for (auto &[T, Result] : Done)
+        complete(T, Result);
+    }
+
+    for (size_t i = Pipes.size(); i-- > 0;) {
+      if (!Fds[i + 1].revents || readPipe(Pipes[i]))
+        continue;
+      PipeRead P = std::move(Pipes[i]);
+      Pipes.erase(Pipes.begin() + i);
+      pclose(P.Proc);
+      complete(P.Task, toHandle(makeString(P.Data.data(), P.Data.size(),
+                                           /*useArena=*/false)));
+    }
+
+    TimePoint Now = std::chrono::steady_clock::now();
+    while (!Timers.empty() && Timers.begin()->first <= Now) {
+      FermatTask *T = Timers.begin()->second;
+      Timers.erase(Timers.begin());
+      complete(T, 0.0);
+    }
+  }
+};
+
+// Loops live for the rest of the process, since the I/O thread may still
+// post to a loop whose thread stopped waiting
+static EventLoop &currentLoop() {
+  static thread_local EventLoop *Loop = new EventLoop();
+  return *Loop;
+}
+
+// Runs blocking file operations one after another
+struct IoThread {
+  struct Op {
+    EventLoop *Loop;
+    FermatTask *Task;
+    std::function<double()> Run;
+  };
+
+  std::mutex Lock;
+  std::condition_variable Wake;
+  std::deque<Op> Ops;
+
+  IoThread() { std::thread(&IoThread::loop, this).detach(); }
+
+  void submit(FermatTask *T, std::function<double()> Run) {
+    EventLoop &Loop = currentLoop();
+    ++Loop.PendingFileOps;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Ops.push_back({&Loop, T, std::move(Run)});
+    }
+    Wake.notify_one();
+  }
+
+  void loop() {
+    while (true) {
+      std::unique_lock<std::mutex> Guard(Lock);
+      Wake.wait(Guard, [this] { return !Ops.empty(); });
+      Op Next = std::move(Ops.front());
+      Ops.pop_front();
+      Guard.unlock();
+      Next.Loop->post(Next.Task, Next.Run());
+    }
+  }
+};
+
+static IoThread &getIoThread() {
+  static IoThread *Thread = new IoThread();
+  return *Thread;
+}
 
 extern "C" {
 
 // --- IO ---
 double fermat_print(double val) {
-  fprintf(stdout, "%g", val);
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  printNumber(val);
   return 0.0;
 }
 
 double fermat_println(double val) {
-  fprintf(stdout, "%g\n", val);
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  printNumber(val);
+  if (!Out.Binary)
+    Out.endLine();
+  return 0.0;
+}
+
+double fermat_flush() {
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  Out.flush();
+  return 0.0;
+}
+
+// In binary mode numbers are written as raw native-endian doubles
+double fermat_set_binary_output(double on) {
+  Out.Binary = on != 0.0;
+  return 0.0;
+}
+
+double fermat_write_f64(double val) {
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  Out.write(reinterpret_cast<const char *>(&val), sizeof(val));
+  return 0.0;
+}
+
+// Print a whole list in one call, elements separated by the string sep
+// (a single space when sep is 0) and followed by a newline. In binary mode
+// the elements are written as one block of raw doubles.
+double fermat_print_list(double list, double sep) {
+  auto *vec = fromHandle<FermatList>(list);
+  if (!vec)
+    return 0.0;
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  if (Out.Binary) {
+    Out.write(reinterpret_cast<const char *>(vec->data()),
+              vec->size() * sizeof(double));
+    return 0.0;
+  }
+
+  std::string_view sepView = sep != 0.0 ? stringView(sep) : " ";
+  char buf[32];
+  for (size_t i = 0; i < vec->size(); ++i) {
+    if (i)
+      Out.write(sepView.data(), sepView.size());
+    Out.write(buf, formatNumber(buf, sizeof(buf), (*vec)[i]));
+  }
+  Out.endLine();
+  return 0.0;
+}
+
+// --- Strings ---
+
+// Backs string literals in generated code; literals are always interned
+double fermat_str_lit(const char *data, int64_t len) {
+  return toHandle(internString(data, (size_t)len));
+}
+
+double fermat_str_free(double str) {
+  freeString(fromHandle<FermatString>(str));
+  return 0.0;
+}
+
+double fermat_str_len(double str) { return (double)stringView(str).size(); }
+
+double fermat_str_concat(double a, double b) {
+  std::string_view sa = stringView(a), sb = stringView(b);
+  FermatString *s = makeString(nullptr, sa.size() + sb.size());
+  char *dst = const_cast<char *>(s->data());
+  std::memcpy(dst, sa.data(), sa.size());
+  std::memcpy(dst + sa.size(), sb.data(), sb.size());
+  return toHandle(s);
+}
+
+// Bytes [start, end) clamped to the string
+double fermat_str_slice(double str, double start, double end) {
+  std::string_view sv = stringView(str);
+  size_t b = start < 0 ? 0 : std::min((size_t)start, sv.size());
+  size_t e = end < 0 ? 0 : std::min((size_t)end, sv.size());
+  if (e < b)
+    e = b;
+  return toHandle(makeString(sv.data() + b, e - b));
+}
+
+double fermat_str_char_at(double str, double idx) {
+  std::string_view sv = stringView(str);
+  size_t i = (size_t)idx;
+  if (idx < 0 || i >= sv.size())
+    return -1.0;
+  return (double)(unsigned char)sv[i];
+}
+
+double fermat_str_find(double str, double needle) {
+  size_t pos = stringView(str).find(stringView(needle));
+  return pos == std::string_view::npos ? -1.0 : (double)pos;
+}
+
+double fermat_str_eq(double a, double b) {
+  return stringsEqual(fromHandle<FermatString>(a), fromHandle<FermatString>(b))
+             ? 1.0
+             : 0.0;
+}
+
+double fermat_str_cmp(double a, double b) {
+  int c = stringView(a).compare(stringView(b));
+  return c < 0 ? -1.0 : (c > 0 ? 1.0 : 0.0);
+}
+
+double fermat_str_hash(double str) {
+  FermatString *s = fromHandle<FermatString>(str);
+  return s ? (double)stringHash(s) : 0.0;
+}
+
+double fermat_str_intern(double str) {
+  FermatString *s = fromHandle<FermatString>(str);
+  if (!s)
+    return 0.0;
+  if (s->Flags & FermatString::Interned)
+    return str;
+  return toHandle(internString(s->data(), s->Len));
+}
+
+double fermat_str_from_num(double val) {
+  char buf[32];
+  return toHandle(makeString(buf, formatNumber(buf, sizeof(buf), val)));
+}
+
+double fermat_str_to_num(double str) {
+  FermatString *s = fromHandle<FermatString>(str);
+  return s ? strtod(s->data(), nullptr) : 0.0;
+}
+
+double fermat_str_print(double str) {
+  std::string_view sv = stringView(str);
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  Out.write(sv.data(), sv.size());
+  return 0.0;
+}
+
+double fermat_str_println(double str) {
+  std::string_view sv = stringView(str);
+  std::lock_guard<std::mutex> Guard(Out.Lock);
+  Out.write(sv.data(), sv.size());
+  Out.endLine();
+  return 0.0;
+}
+
+// --- String builder ---
+
+double fermat_sb_create() { return toHandle(new StringBuilder()); }
+
+double fermat_sb_free(double sb) {
+  delete fromHandle<StringBuilder>(sb);
+  return 0.0;
+}
+
+double fermat_sb_append(double sb, double str) {
+  if (auto *b = fromHandle<StringBuilder>(sb))
+    b->Buf.append(stringView(str));
+  return 0.0;
+}
+
+double fermat_sb_append_num(double sb, double val) {
+  if (auto *b = fromHandle<StringBuilder>(sb)) {
+    char buf[32];
+    b->Buf.append(buf, formatNumber(buf, sizeof(buf), val));
+  }
+  return 0.0;
+}
+
+double fermat_sb_append_char(double sb, double code) {
+  if (auto *b = fromHandle<StringBuilder>(sb))
+    b->Buf.push_back((char)(int)code);
+  return 0.0;
+}
+
+double fermat_sb_len(double sb) {
+  auto *b = fromHandle<StringBuilder>(sb);
+  return b ? (double)b->Buf.size() : 0.0;
+}
+
+// Copy the contents out as a new string and reset the builder
+double fermat_sb_finish(double sb) {
+  auto *b = fromHandle<StringBuilder>(sb);
+  if (!b)
+    return 0.0;
+  FermatString *s = makeString(b->Buf.data(), b->Buf.size());
+  b->Buf.clear();
+  return toHandle(s);
+}
+
+// --- CSV ---
+
+// Read a whole file into per-column lists. delim is a string whose first
+// character separates fields (',' when 0); header skips the first line.
+double fermat_csv_read(double path, double delim, double header) {
+  size_t size = 0;
+  int fd = openCsv(path, &size);
+  if (fd < 0)
+    return 0.0;
+
+  CsvTable *T = new CsvTable();
+  T->Delim = csvDelimiter(delim);
+  T->HeaderPending = header != 0.0;
+
+  if (size > 0) {
+    void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base != MAP_FAILED) {
+      madvise(base, size, MADV_SEQUENTIAL);
+      const char *data = static_cast<const char *>(base);
+      const char *end = data + size;
+
+      // Size the columns from the first data line's share of the file
+      const char *p = T->parseRows(data, end, true, 1);
+      if (T->Rows && p > data)
+        T->reserve(size / (size_t)(p - data) + 1);
+      T->parseRows(p, end, true, SIZE_MAX);
+      munmap(base, size);
+    }
+  }
+  close(fd);
+  return toHandle(T);
+}
+
+// Open a file for chunked reading with fermat_csv_next
+double fermat_csv_open(double path, double delim, double header) {
+  size_t size = 0;
+  int fd = openCsv(path, &size);
+  if (fd < 0)
+    return 0.0;
+
+  CsvTable *T = new CsvTable();
+  T->Delim = csvDelimiter(delim);
+  T->HeaderPending = header != 0.0;
+  T->Fd = fd;
+  T->FileSize = size;
+  return toHandle(T);
+}
+
+// Replace the columns with up to maxRows further rows; 0 at end of file
+double fermat_csv_next(double table, double maxRows) {
+  auto *T = fromHandle<CsvTable>(table);
+  if (!T || T->Fd < 0 || maxRows < 1)
+    return 0.0;
+
+  for (FermatList *col : T->Columns)
+    col->clear();
+  T->Rows = 0;
+
+  static const size_t PageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t window = 64 * 1024 * 1024;
+  size_t limit = (size_t)maxRows;
+  while (T->Rows < limit && T->Offset < T->FileSize) {
+    // Map from the page holding the next unparsed byte
+    size_t start = T->Offset & ~(PageSize - 1);
+    size_t len = std::min(window, T->FileSize - start);
+    void *base =
+        mmap(nullptr, len, PROT_READ, MAP_PRIVATE, T->Fd, (off_t)start);
+    if (base == MAP_FAILED)
+      break;
+    madvise(base, len, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(base);
+    const char *p = data + (T->Offset - start);
+    bool atEof = start + len == T->FileSize;
+    const char *stop = T->parseRows(p, data + len, atEof, limit - T->Rows);
+    munmap(base, len);
+
+    if (stop == p)
+      window *= 2; // A line longer than the window
+    T->Offset += (size_t)(stop - p);
+  }
+  return (double)T->Rows;
+}
+
+double fermat_csv_rows(double table) {
+  auto *T = fromHandle<CsvTable>(table);
+  return T ? (double)T->Rows : 0.0;
+}
+
+double fermat_csv_columns(double table) {
+  auto *T = fromHandle<CsvTable>(table);
+  return T ? (double)T->Columns.size() : 0.0;
+}
+
+// Column lists belong to the table and are freed with it
+double fermat_csv_column(double table, double idx) {
+  auto *T = fromHandle<CsvTable>(table);
+  if (!T || idx < 0 || (size_t)idx >= T->Columns.size())
+    return 0.0;
+  return toHandle(T->Columns[(size_t)idx]);
+}
+
+double fermat_csv_free(double table) {
+  delete fromHandle<CsvTable>(table);
+  return 0.0;
+}
+
+// --- Parallel loops and tasks ---
+
+// Run body over ranges covering [0, n) on the thread pool; returns once
+// all iterations are done
+double fermat_parallel_for(int64_t n, ChunkFn body, void *env) {
+  if (n <= 0)
+    return 0.0;
+  ThreadPool *Pool = getThreadPool();
+  if (Pool->NumThreads == 1 || n == 1) {
+    body(0, n, env);
+    return 0.0;
+  }
+
+  ParallelJob Job(env, Pool->grainFor(n), n);
+  Job.Body = body;
+  Pool->runJob(Job, n);
+  return 0.0;
+}
+
+// Reduce [0, n) with op: partial(lo, hi, env) folds a range from the
+// identity, results are folded into a partial per thread and those are
+// merged pairwise
+double fermat_parallel_reduce(int64_t n, PartialFn partial, void *env,
+                              int64_t op) {
+  ThreadPool *Pool = getThreadPool();
+  if (n <= 1 || Pool->NumThreads == 1)
+    return partial(0, n, env);
+
+  ParallelJob Job(env, Pool->grainFor(n), n);
+  Job.Partial = partial;
+  Job.Op = (int)op;
+  Job.Partials.assign(Pool->NumThreads, {reduceIdentity((int)op)});
+  Pool->runJob(Job, n);
+
+  std::vector<ReducePartial> &P = Job.Partials;
+  for (size_t Stride = 1; Stride < P.size(); Stride *= 2)
+    for (size_t i = 0; i + Stride < P.size(); i += 2 * Stride)
+      P[i].Value = reduceCombine(Job.Op, P[i].Value, P[i + Stride].Value);
+  return P[0].Value;
+}
+
+double fermat_num_threads() { return (double)getThreadPool()->NumThreads; }
+
+// Start a task computing fn(env) and return a future for its result. env
+// is copied, since the spawning frame may return before the task runs.
+double fermat_spawn(TaskFn fn, void *env, int64_t size) {
+  ThreadPool *Pool = getThreadPool();
+  auto *F = new FermatFuture();
+  F->Fn = fn;
+  F->Env = malloc((size_t)size);
+  std::memcpy(F->Env, env, (size_t)size);
+  Pool->spawn(F);
+  return toHandle(F);
+}
+
+// Wait for a future, running other pool work meanwhile, and free it
+double fermat_join(double future) {
+  auto *F = fromHandle<FermatFuture>(future);
+  if (!F)
+    return 0.0;
+  getThreadPool()->helpUntil(
+      [F] { return F->Done.load(std::memory_order_acquire); });
+  double Result = F->Result;
+  free(F->Env);
+  delete F;
+  return Result;
+}
+
+// --- Arena ---
+
+double fermat_arena_begin() {
+  Arena *A = new Arena();
+  ArenaStack.push_back(A);
+  return toHandle(A);
+}
+
+double fermat_arena_end() {
+  if (ArenaStack.empty())
+    return 0.0;
+  Arena *A = ArenaStack.back();
+  ArenaStack.pop_back();
+  // Containers in the region only own arena memory, so no destructors run
+  A->release();
+  delete A;
   return 0.0;
 }
 
 // --- ArrayList (std::vector<double>) ---
 
-void *fermat_list_create() { return new std::vector<double>(); }
+double fermat_list_create() { return createCollection<FermatList>(); }
 
-void fermat_list_free(void *ptr) {
-  if (ptr)
-    delete static_cast<std::vector<double> *>(ptr);
+double fermat_list_free(double list) {
+  freeCollection<FermatList>(list);
+  return 0.0;
 }
 
-void fermat_list_push(void *ptr, double val) {
-  if (ptr)
-    static_cast<std::vector<double> *>(ptr)->push_back(val);
+double fermat_list_push(double list, double val) {
+  if (auto *vec = fromHandle<FermatList>(list))
+    vec->push_back(val);
+  return 0.0;
 }
 
-double fermat_list_get(void *ptr, double idx) {
-  if (!ptr)
+double fermat_list_get(double list, double idx) {
+  auto *vec = fromHandle<FermatList>(list);
+  if (!vec)
     return 0.0;
-  auto *vec = static_cast<std::vector<double> *>(ptr);
   size_t i = (size_t)idx;
   if (i < vec->size())
     return (*vec)[i];
   return 0.0; // Error / Out of bounds
 }
 
-void fermat_list_set(void *ptr, double idx, double val) {
-  if (!ptr)
-    return;
-  auto *vec = static_cast<std::vector<double> *>(ptr);
+double fermat_list_set(double list, double idx, double val) {
+  auto *vec = fromHandle<FermatList>(list);
+  if (!vec)
+    return 0.0;
   size_t i = (size_t)idx;
   if (i < vec->size())
     (*vec)[i] = val;
+  return 0.0;
 }
 
-double fermat_list_size(void *ptr) {
-  if (!ptr)
+double fermat_list_size(double list) {
+  auto *vec = fromHandle<FermatList>(list);
+  if (!vec)
     return 0.0;
-  return (double)static_cast<std::vector<double> *>(ptr)->size();
+  return (double)vec->size();
 }
 
 // --- Map (std::map<double, double>) ---
 
-void *fermat_map_create() { return new std::map<double, double>(); }
+double fermat_map_create() { return createCollection<FermatMap>(); }
 
-void fermat_map_free(void *ptr) {
-  if (ptr)
-    delete static_cast<std::map<double, double> *>(ptr);
+double fermat_map_free(double map) {
+  freeCollection<FermatMap>(map);
+  return 0.0;
 }
 
-void fermat_map_put(void *ptr, double key, double val) {
-  if (ptr)
-    (*static_cast<std::map<double, double> *>(ptr))[key] = val;
+double fermat_map_put(double map, double key, double val) {
+  if (auto *m = fromHandle<FermatMap>(map))
+    (*m)[key] = val;
+  return 0.0;
 }
 
-double fermat_map_get(void *ptr, double key) {
-  if (!ptr)
+double fermat_map_get(double map, double key) {
+  auto *m = fromHandle<FermatMap>(map);
+  if (!m)
     return 0.0;
-  auto *m = static_cast<std::map<double, double> *>(ptr);
   auto it = m->find(key);
   if (it != m->end())
     return it->second;
   return 0.0; // Not found default
 }
 
-double fermat_map_check(void *ptr, double key) {
-  if (!ptr)
+double fermat_map_check(double map, double key) {
+  auto *m = fromHandle<FermatMap>(map);
+  if (!m)
     return 0.0;
-  auto *m = static_cast<std::map<double, double> *>(ptr);
   return (m->find(key) != m->end()) ? 1.0 : 0.0;
 }
 
-double fermat_map_size(void *ptr) {
-  if (!ptr)
+double fermat_map_size(double map) {
+  auto *m = fromHandle<FermatMap>(map);
+  if (!m)
     return 0.0;
-  return (double)static_cast<std::map<double, double> *>(ptr)->size();
+  return (double)m->size();
 }
 
 // --- Set (std::set<double>) ---
 
-void *fermat_set_create() { return new std::set<double>(); }
+double fermat_set_create() { return createCollection<FermatSet>(); }
 
-void fermat_set_free(void *ptr) {
-  if (ptr)
-    delete static_cast<std::set<double> *>(ptr);
+double fermat_set_free(double set) {
+  freeCollection<FermatSet>(set);
+  return 0.0;
 }
 
-void fermat_set_add(void *ptr, double val) {
-  if (ptr)
-    static_cast<std::set<double> *>(ptr)->insert(val);
+double fermat_set_add(double set, double val) {
+  if (auto *s = fromHandle<FermatSet>(set))
+    s->insert(val);
+  return 0.0;
 }
 
-double fermat_set_contains(void *ptr, double val) {
-  if (!ptr)
+double fermat_set_contains(double set, double val) {
+  auto *s = fromHandle<FermatSet>(set);
+  if (!s)
     return 0.0;
-  auto *s = static_cast<std::set<double> *>(ptr);
   return (s->find(val) != s->end()) ? 1.0 : 0.0;
 }
 
-double fermat_set_size(void *ptr) {
-  if (!ptr)
+double fermat_set_size(double set) {
+  auto *s = fromHandle<FermatSet>(set);
+  if (!s)
+    return 0.0;
+  return (double)s->size();
+}
+
+// --- Concurrent map ---
+
+double fermat_cmap_create() { return toHandle(new ConcurrentMap()); }
+
+double fermat_cmap_free(double map) {
+  delete fromHandle<ConcurrentMap>(map);
+  return 0.0;
+}
+
+double fermat_cmap_put(double map, double key, double val) {
+  if (auto *m = fromHandle<ConcurrentMap>(map)) {
+    ConcurrentMap::Shard &S = m->shardFor(key);
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    S.Map[key] = val;
+  }
+  return 0.0;
+}
+
+double fermat_cmap_get(double map, double key) {
+  auto *m = fromHandle<ConcurrentMap>(map);
+  if (!m)
+    return 0.0;
+  ConcurrentMap::Shard &S = m->shardFor(key);
+  std::lock_guard<std::mutex> Guard(S.Lock);
+  auto it = S.Map.find(key);
+  return it != S.Map.end() ? it->second : 0.0;
+}
+
+double fermat_cmap_check(double map, double key) {
+  auto *m = fromHandle<ConcurrentMap>(map);
+  if (!m)
+    return 0.0;
+  ConcurrentMap::Shard &S = m->shardFor(key);
+  std::lock_guard<std::mutex> Guard(S.Lock);
+  return S.Map.count(key) ? 1.0 : 0.0;
+}
+
+// Atomically add delta to the value at key (inserting delta if absent)
+// and return the new value
+double fermat_cmap_add(double map, double key, double delta) {
+  auto *m = fromHandle<ConcurrentMap>(map);
+  if (!m)
     return 0.0;
-  return (double)static_cast<std::set<double> *>(ptr)->size();
+  ConcurrentMap::Shard &S = m->shardFor(key);
+  std::lock_guard<std::mutex> Guard(S.Lock);
+  return S.Map[key] += delta;
+}
+
+// Insert val unless key is present; returns the value now at key
+double fermat_cmap_put_if_absent(double map, double key, double val) {
+  auto *m = fromHandle<ConcurrentMap>(map);
+  if (!m)
+    return 0.0;
+  ConcurrentMap::Shard &S = m->shardFor(key);
+  std::lock_guard<std::mutex> Guard(S.Lock);
+  return S.Map.emplace(key, val).first->second;
+}
+
+double fermat_cmap_size(double map) {
+  auto *m = fromHandle<ConcurrentMap>(map);
+  if (!m)
+    return 0.0;
+  size_t n = 0;
+  for (ConcurrentMap::Shard &S : m->Shards) {
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    n += S.Map.size();
+  }
+  return (double)n;
+}
+
+// --- Concurrent queue ---
+
+double fermat_queue_create(double capacity) {
+  return toHandle(new ConcurrentQueue(capacity < 2 ? 2 : (size_t)capacity));
+}
+
+double fermat_queue_free(double queue) {
+  delete fromHandle<ConcurrentQueue>(queue);
+  return 0.0;
+}
+
+// Returns 1 if val was added, 0 if the queue is full
+double fermat_queue_try_push(double queue, double val) {
+  auto *q = fromHandle<ConcurrentQueue>(queue);
+  return q && q->tryPush(val) ? 1.0 : 0.0;
+}
+
+// Returns the oldest value, or fallback if the queue is empty
+double fermat_queue_try_pop(double queue, double fallback) {
+  auto *q = fromHandle<ConcurrentQueue>(queue);
+  double val;
+  return q && q->tryPop(val) ? val : fallback;
+}
+
+// Blocking variants yield the thread while they wait. Unlike joins they
+// do not run other pool work meanwhile: that could start the very task
+// they wait for on top of them, which would then wait for them in turn.
+// When every thread may be waiting, a helper thread runs it instead.
+
+double fermat_queue_push(double queue, double val) {
+  auto *q = fromHandle<ConcurrentQueue>(queue);
+  if (!q)
+    return 0.0;
+  getThreadPool()->waitUntil([&] { return q->tryPush(val); });
+  return 1.0;
+}
+
+double fermat_queue_pop(double queue) {
+  auto *q = fromHandle<ConcurrentQueue>(queue);
+  if (!q)
+    return 0.0;
+  double val = 0.0;
+  getThreadPool()->waitUntil([&] { return q->tryPop(val); });
+  return val;
+}
+
+double fermat_queue_size(double queue) {
+  auto *q = fromHandle<ConcurrentQueue>(queue);
+  return q ? (double)q->size() : 0.0;
+}
+
+// --- Atomic cells and channels ---
+
+// An atomic cell is one 8-byte value, an int64 or a double, on a cache
+// line of its own so that counters next to each other do not contend.
+// Generated code accesses it with atomic instructions directly.
+static double makeAtomicCell(const void *init) {
+  void *cell = std::aligned_alloc(64, 64);
+  if (!cell)
+    return 0.0;
+  std::memcpy(cell, init, 8);
+  return toHandle(cell);
+}
+
+double fermat_atomic_int(double value) {
+  int64_t v = (int64_t)value;
+  return makeAtomicCell(&v);
+}
+
+double fermat_atomic_float(double value) { return makeAtomicCell(&value); }
+
+double fermat_atomic_free(double cell) {
+  std::free(fromHandle<void>(cell));
+  return 0.0;
+}
+
+double fermat_chan_create(double capacity) {
+  return toHandle(new Channel(capacity < 2 ? 2 : (size_t)capacity));
+}
+
+double fermat_chan_free(double chan) {
+  delete fromHandle<Channel>(chan);
+  return 0.0;
+}
+
+// Returns 1 once val is in the channel, 0 if the channel is closed
+double fermat_chan_send(double chan, double val) {
+  auto *c = fromHandle<Channel>(chan);
+  return c && c->send(val) ? 1.0 : 0.0;
+}
+
+// Returns the oldest value, or fallback once the channel is closed and
+// empty
+double fermat_chan_recv(double chan, double fallback) {
+  auto *c = fromHandle<Channel>(chan);
+  double val;
+  return c && c->recv(val) ? val : fallback;
+}
+
+double fermat_chan_close(double chan) {
+  if (auto *c = fromHandle<Channel>(chan))
+    c->close();
+  return 0.0;
+}
+
+// --- Async tasks ---
+
+// Called by async functions: create the task of a call, finish it with
+// the body's value, and in await check, suspend on and consume a task
+double fermat_task_create() { return toHandle(new FermatTask()); }
+
+double fermat_task_complete(double task, double result) {
+  if (auto *T = fromHandle<FermatTask>(task))
+    currentLoop().complete(T, result);
+  return 0.0;
+}
+
+double fermat_task_ready(double task) {
+  auto *T = fromHandle<FermatTask>(task);
+  return !T || T->Done ? 1.0 : 0.0;
+}
+
+double fermat_task_suspend(double task, void *frame) {
+  auto *T = fromHandle<FermatTask>(task);
+  if (!T)
+    return 0.0;
+  if (T->Waiter) {
+    fprintf(stderr, "Runtime error: task awaited twice\n");
+    exit(1);
+  }
+  T->Waiter = frame;
+  return 0.0;
+}
+
+double fermat_task_result(double task) {
+  auto *T = fromHandle<FermatTask>(task);
+  if (!T)
+    return 0.0;
+  double Result = T->Result;
+  delete T;
+  return Result;
+}
+
+// await outside an async function: run the event loop until the task is
+// done, then return its value and free it
+double fermat_await(double task) {
+  auto *T = fromHandle<FermatTask>(task);
+  if (!T)
+    return 0.0;
+  EventLoop &Loop = currentLoop();
+  while (!T->Done) {
+    if (Loop.idle()) {
+      fprintf(stderr, "Runtime error: awaited task can never finish\n");
+      delete T;
+      return 0.0;
+    }
+    Loop.runOnce();
+  }
+  return fermat_task_result(task);
+}
+
+// Read a whole file into a new string (0 if it cannot be read)
+double fermat_async_read_file(double path) {
+  auto *T = new FermatTask();
+  std::string Path(stringView(path));
+  getIoThread().submit(T, [Path] {
+    FILE *F = fopen(Path.c_str(), "rb");
+    if (!F) {
+      fprintf(stderr, "Error: Cannot open '%s'\n", Path.c_str());
+      return 0.0;
+    }
+    std::string Data;
+    char Buf[65536];
+    size_t n;
+    while ((n = fread(Buf, 1, sizeof(Buf), F)) > 0)
+      Data.append(Buf, n);
+    fclose(F);
+    return toHandle(makeString(Data.data(), Data.size(), /*useArena=*/false));
+  });
+  return toHandle(T);
+}
+
+// Replace a file's contents with str; the task gives the bytes written,
+// or -1 on error
+double fermat_async_write_file(double path, double str) {
+  auto *T = new FermatTask();
+  std::string Path(stringView(path)), Data(stringView(str));
+  getIoThread().submit(T, [Path, Data] {
+    FILE *F = fopen(Path.c_str(), "wb");
+    if (!F) {
+      fprintf(stderr, "Error: Cannot open '%s'\n", Path.c_str());
+      return -1.0;
+    }
+    size_t n = fwrite(Data.data(), 1, Data.size(), F);
+    fclose(F);
+    return (double)n;
+  });
+  return toHandle(T);
+}
+
+// Run a shell command; the task gives everything it wrote to stdout
+double fermat_async_exec(double cmd) {
+  auto *T = new FermatTask();
+  std::string Cmd(stringView(cmd));
+  FILE *Proc = popen(Cmd.c_str(), "r");
+  if (!Proc) {
+    fprintf(stderr, "Error: Cannot run '%s'\n", Cmd.c_str());
+    currentLoop().complete(T, 0.0);
+    return toHandle(T);
+  }
+  int Fd = fileno(Proc);
+  fcntl(Fd, F_SETFL, fcntl(Fd, F_GETFL) | O_NONBLOCK);
+  currentLoop().Pipes.push_back({Proc, Fd, std::string(), T});
+  return toHandle(T);
+}
+
+double fermat_async_sleep(double seconds) {
+  auto *T = new FermatTask();
+  auto Delay = std::chrono::duration<double>(seconds > 0 ? seconds : 0.0);
+  currentLoop().Timers.emplace(
+      std::chrono::steady_clock::now() +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              Delay),
+      T);
+  return toHandle(T);
 }
 
 } // extern "C"
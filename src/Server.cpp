@@ -0,0 +1,207 @@
+#include "Server.h"
+#include "BorrowCheck.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "Lexer.h"
+#include "ModuleLoader.h"
+#include "Parser.h"
+#include "llvm/ADT/DenseSet.h"
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Runtime.cpp output buffer
+extern "C" double fermat_flush();
+extern "C" double fermat_set_binary_output(double on);
+
+// A request is the script's absolute path on one line, followed by its
+// source. The client then shuts down its side of the connection and reads
+// the script's output, stdout and stderr interleaved, until the server
+// closes it.
+
+static bool makeAddress(const std::string &SocketPath, sockaddr_un &Addr) {
+  Addr = sockaddr_un();
+  Addr.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Error: Socket path too long: %s\n", SocketPath.c_str());
+    return false;
+  }
+  SocketPath.copy(Addr.sun_path, SocketPath.size());
+  return true;
+}
+
+static bool writeAll(int Fd, const char *Data, size_t Len) {
+  while (Len) {
+    ssize_t n = write(Fd, Data, Len);
+    if (n < 0)
+      return false;
+    Data += n;
+    Len -= (size_t)n;
+  }
+  return true;
+}
+
+static std::string readAll(int Fd) {
+  std::string Data;
+  char Buf[65536];
+  ssize_t n;
+  while ((n = read(Fd, Buf, sizeof(Buf))) > 0)
+    Data.append(Buf, (size_t)n);
+  return Data;
+}
+
+// Names the compiler knows before a script runs. Whatever the script adds
+// is forgotten afterwards, since its code goes away with its dylib.
+struct CompilerSnapshot {
+  DenseSet<Symbol> Functions, Structs;
+  std::set<std::string> Modules;
+
+  CompilerSnapshot() : Modules(ImportedModules) {
+    for (auto &Entry : FunctionProtos)
+      Functions.insert(Entry.first);
+    for (auto &Entry : StructTypes)
+      Structs.insert(Entry.first);
+  }
+
+  // Erasing from a DenseMap leaves its other iterators valid
+  template <typename MapT>
+  static void eraseAdded(MapT &Map, const DenseSet<Symbol> &Keep) {
+    for (auto It = Map.begin(); It != Map.end(); ++It)
+      if (!Keep.count(It->first))
+        Map.erase(It);
+  }
+
+  void restore() {
+    eraseAdded(FunctionProtos, Functions);
+    eraseAdded(StructTypes, Structs);
+    ImportedModules = Modules;
+    TheBorrowChecker = BorrowChecker();
+  }
+};
+
+// Run one script with stdout and stderr sent to Conn
+static void serveScript(int Conn, unsigned ScriptId) {
+  std::string Request = readAll(Conn);
+  size_t NewLine = Request.find('\n');
+  if (NewLine == std::string::npos)
+    return;
+  std::string Path = Request.substr(0, NewLine);
+  std::string Source = Request.substr(NewLine + 1);
+
+  CompilerSnapshot Snapshot;
+  ExecutionSession &ES = TheJIT->getExecutionSession();
+  JITDylib &Main = TheJIT->getMainJITDylib();
+  JITDylib &Script =
+      ExitOnErr(ES.createJITDylib("script" + std::to_string(ScriptId)));
+  Script.addToLinkOrder(Main);
+  CurrentDylib = &Script;
+
+  fflush(stdout);
+  fflush(stderr);
+  int SavedOut = dup(STDOUT_FILENO), SavedErr = dup(STDERR_FILENO);
+  dup2(Conn, STDOUT_FILENO);
+  dup2(Conn, STDERR_FILENO);
+
+  setInputString(std::move(Source), Path);
+  getNextToken();
+  MainLoop();
+  fermat_flush();
+  fermat_set_binary_output(0);
+  fflush(stderr);
+
+  dup2(SavedOut, STDOUT_FILENO);
+  dup2(SavedErr, STDERR_FILENO);
+  close(SavedOut);
+  close(SavedErr);
+
+  CurrentDylib = &Main;
+  if (Error Err = ES.removeJITDylib(Script))
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+  Snapshot.restore();
+
+  // Drop what a failed definition may have left in the current module
+  TheModule.reset();
+  InitializeModuleAndPassManager();
+}
+
+int RunServer(const std::string &SocketPath,
+              const std::vector<std::string> &Libraries) {
+  // Load the libraries into the main dylib and compile them up front
+  std::vector<std::string> Paths;
+  for (const std::string &Lib : Libraries)
+    Paths.push_back(std::filesystem::absolute(Lib).string());
+  loadModules(Paths);
+  CompileAllFunctions();
+
+  sockaddr_un Addr;
+  if (!makeAddress(SocketPath, Addr))
+    return 1;
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(SocketPath.c_str());
+  if (Listener < 0 || bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) != 0 ||
+      listen(Listener, 16) != 0) {
+    perror("Error: Cannot listen on socket");
+    return 1;
+  }
+
+  // A client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "Serving on %s\n", SocketPath.c_str());
+
+  for (unsigned ScriptId = 0;; ++ScriptId) {
+    int Conn = accept(Listener, nullptr, nullptr);
+    if (Conn < 0)
+      continue;
+    serveScript(Conn, ScriptId);
+    close(Conn);
+  }
+}
+
+int RunClient(const std::string &SocketPath, const char *ScriptPath) {
+  std::string Path = ".";
+  std::string Source;
+  if (ScriptPath) {
+    FILE *File = fopen(ScriptPath, "r");
+    if (!File) {
+      fprintf(stderr, "Error: Could not open file %s\n", ScriptPath);
+      return 1;
+    }
+    Source = readAll(fileno(File));
+    fclose(File);
+    Path = ScriptPath;
+  } else {
+    Source = readAll(STDIN_FILENO);
+  }
+  // Imports are resolved relative to the script, on the server's side
+  Path = std::filesystem::absolute(Path).string();
+
+  sockaddr_un Addr;
+  if (!makeAddress(SocketPath, Addr))
+    return 1;
+  int Conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Conn < 0 || connect(Conn, (sockaddr *)&Addr, sizeof(Addr)) != 0) {
+    perror("Error: Cannot connect to server");
+    return 1;
+  }
+
+  std::string Request = Path + "\n" + Source;
+  if (!writeAll(Conn, Request.data(), Request.size())) {
+    perror("Error: Cannot send script");
+    return 1;
+  }
+  shutdown(Conn, SHUT_WR);
+
+  char Buf[65536];
+  ssize_t n;
+  while ((n = read(Conn, Buf, sizeof(Buf))) > 0)
+    writeAll(STDOUT_FILENO, Buf, (size_t)n);
+  close(Conn);
+  return 0;
+}
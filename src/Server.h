@@ -0,0 +1,17 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+
+// Server mode: keep the JIT and the given libraries loaded, and run each
+// script sent over the Unix socket at SocketPath in a dylib of its own.
+// Returns only if the socket cannot be set up.
+int RunServer(const std::string &SocketPath,
+              const std::vector<std::string> &Libraries);
+
+// Send a script (stdin when ScriptPath is null) to a server and copy its
+// output to stdout
+int RunClient(const std::string &SocketPath, const char *ScriptPath);
+
+#endif // SERVER_H
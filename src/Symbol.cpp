@@ -0,0 +1,86 @@
+#include "Symbol.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <atomic>
+#include <mutex>
+
+using namespace llvm;
+
+namespace {
+using SymbolEntry = StringMapEntry<uint32_t>;
+
+constexpr unsigned NumShardBits = 4;
+constexpr unsigned ChunkBits = 14;
+constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+constexpr size_t NumChunks = size_t(1) << (32 - ChunkBits);
+
+// Names hash to one of several shards with a lock each, so that threads
+// lexing at the same time seldom wait for one another
+struct SymbolShard {
+  std::mutex Lock;
+  StringMap<uint32_t, BumpPtrAllocator> Ids;
+};
+
+// The entries of the shards by ID, in chunks that never move, so that
+// reading a symbol's text takes no lock. An entry is stored before its ID
+// is handed out, and a thread only has an ID if it interned the name, after
+// whichever thread did so first, or was given the symbol by another thread.
+class SymbolTable {
+  SymbolShard Shards[1 << NumShardBits];
+  std::atomic<const SymbolEntry **> Chunks[NumChunks] = {};
+  std::atomic<uint32_t> NextId{0};
+
+  void store(uint32_t Id, const SymbolEntry *Entry) {
+    std::atomic<const SymbolEntry **> &Chunk = Chunks[Id >> ChunkBits];
+    const SymbolEntry **Slots = Chunk.load(std::memory_order_acquire);
+    if (!Slots) {
+      auto *New = new const SymbolEntry *[ChunkSize]();
+      // Whichever thread gets there first provides the chunk
+      if (Chunk.compare_exchange_strong(Slots, New,
+                                        std::memory_order_acq_rel))
+        Slots = New;
+      else
+        delete[] New;
+    }
+    Slots[Id & (ChunkSize - 1)] = Entry;
+  }
+
+public:
+  SymbolTable() { intern(""); }
+
+  uint32_t intern(StringRef Name) {
+    uint32_t Hash = djbHash(Name) * 0x9E3779B1u;
+    SymbolShard &Shard = Shards[Hash >> (32 - NumShardBits)];
+    std::lock_guard<std::mutex> Guard(Shard.Lock);
+    auto [It, Inserted] = Shard.Ids.try_emplace(Name, 0);
+    if (Inserted) {
+      uint32_t Id = NextId.fetch_add(1, std::memory_order_relaxed);
+      if (Id >= DenseMapInfo<Symbol>::getTombstoneKey().id())
+        report_fatal_error("too many distinct names");
+      It->second = Id;
+      store(Id, &*It);
+    }
+    return It->second;
+  }
+
+  StringRef text(uint32_t Id) const {
+    const SymbolEntry **Slots =
+        Chunks[Id >> ChunkBits].load(std::memory_order_acquire);
+    return Slots[Id & (ChunkSize - 1)]->getKey();
+  }
+};
+} // namespace
+
+// Never destroyed, as threads may still be reading symbols at exit
+static SymbolTable &symbolTable() {
+  static SymbolTable *Table = new SymbolTable;
+  return *Table;
+}
+
+uint32_t Symbol::intern(StringRef Name) {
+  return Name.empty() ? 0 : symbolTable().intern(Name);
+}
+
+StringRef Symbol::str() const { return symbolTable().text(Id); }
@@ -0,0 +1,49 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// A name interned process-wide: equal names have equal 32-bit IDs, so
+// symbols compare and hash as integers. The lexer interns identifiers as it
+// reads them. A symbol's text is NUL-terminated and is never freed.
+// Interning is thread-safe, and so is reading the text of a symbol.
+class Symbol {
+  uint32_t Id = 0;
+
+  static uint32_t intern(llvm::StringRef Name);
+
+public:
+  // The empty name
+  Symbol() = default;
+  explicit Symbol(llvm::StringRef Name) : Id(intern(Name)) {}
+
+  static Symbol fromId(uint32_t Id) {
+    Symbol S;
+    S.Id = Id;
+    return S;
+  }
+
+  uint32_t id() const { return Id; }
+  bool empty() const { return Id == 0; }
+  llvm::StringRef str() const;
+  const char *c_str() const { return str().data(); }
+
+  bool operator==(Symbol Other) const { return Id == Other.Id; }
+  bool operator!=(Symbol Other) const { return Id != Other.Id; }
+  // Order of interning, not of the text
+  bool operator<(Symbol Other) const { return Id < Other.Id; }
+};
+
+// Symbols as DenseMap keys; the two largest IDs are never handed out
+namespace llvm {
+template <> struct DenseMapInfo<Symbol> {
+  static Symbol getEmptyKey() { return Symbol::fromId(~0u); }
+  static Symbol getTombstoneKey() { return Symbol::fromId(~0u - 1); }
+  static unsigned getHashValue(Symbol S) { return S.id() * 37u; }
+  static bool isEqual(Symbol A, Symbol B) { return A == B; }
+};
+} // namespace llvm
+
+#endif // SYMBOL_H
@@ -3,77 +3,95 @@
 //===----------------------------------------------------------------------===//
 
 #include "CodeGen.h"
+#include "HotReload.h"
 #include "JIT.h"
 #include "Lexer.h"
+#include "ModuleLoader.h"
 #include "Parser.h"
-#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "Server.h"
 #include "llvm/Support/TargetSelect.h"
 #include <cstdio>
 #include <string>
+#include <vector>
 
 using namespace llvm;
 
 int main(int argc, char *argv[]) {
-  // 1. Initialize LLVM native target for JIT
+  // 1. Handle options. A client only forwards a script, so it starts no JIT.
+  std::string filepath = ".";
+  const char *inputPath = nullptr;
+  const char *servePath = nullptr, *clientPath = nullptr;
+  std::string cacheDir;
+  std::vector<std::string> libraries; // Preloaded in server mode
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--reassociate") {
+      AllowReassociation = true;
+    } else if (arg == "--watch") {
+      WatchImports = true;
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cacheDir = argv[++i];
+    } else if ((arg == "--serve" || arg == "--client") && i + 1 < argc) {
+      (arg == "--serve" ? servePath : clientPath) = argv[++i];
+    } else if (arg.rfind("--", 0) == 0) {
+      fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+      return 1;
+    } else if (servePath) {
+      libraries.push_back(argv[i]);
+    } else if (!inputPath) {
+      inputPath = argv[i];
+    }
+  }
+  if (clientPath)
+    return RunClient(clientPath, inputPath);
+  if (WatchImports && servePath) {
+    fprintf(stderr, "Error: --watch cannot be used with --serve\n");
+    return 1;
+  }
+
+  // 2. Initialize LLVM native target for JIT
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
-  // 2. Setup operator precedences
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['>'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;
-  BinopPrecedence['/'] = 40;
-  BinopPrecedence[';'] = 1;
-  BinopPrecedence[tok_eq] = 10;
-  BinopPrecedence[tok_ne] = 10;
+  // 3. Setup operator precedences
+  InitializeBinopPrecedence();
 
-  // 3. Handle input source (file vs terminal)
-  std::string filepath = ".";
-  if (argc > 1) {
-    filepath = argv[1];
-    FILE *file = fopen(filepath.c_str(), "r");
-    if (!file) {
-      fprintf(stderr, "Error: Could not open file %s\n", argv[1]);
+  // 4. Input source (file vs terminal)
+  if (inputPath) {
+    filepath = inputPath;
+    if (!setInputFile(filepath)) {
+      fprintf(stderr, "Error: Could not open file %s\n", inputPath);
       return 1;
     }
-    setInputFile(file, filepath);
   } else {
-    setInputFile(stdin, ".");
+    setInputStream(stdin, ".");
   }
 
-  // 4. Create the JIT engine
-  auto JITExpected = LLJITBuilder().create();
-  if (!JITExpected) {
-    errs() << "Failed to create JIT: " << toString(JITExpected.takeError())
-           << "\n";
+  // 5. Create the JIT engine and a fresh module. Reloads compile on a thread
+  // of their own.
+  if (Error Err = InitializeJIT(/*ConcurrentCompilation=*/WatchImports,
+                                cacheDir)) {
+    errs() << "Failed to create JIT: " << toString(std::move(Err)) << "\n";
     return 1;
   }
-  TheJIT = std::move(*JITExpected);
-
-  // Register host process symbols for Runtime.cpp
-  const char dl_pre[2] = {0, 0}; // Empty prefix for dlsym
-  TheJIT->getMainJITDylib().addGenerator(
-      cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(dl_pre[0])));
+  if (servePath)
+    return RunServer(servePath, libraries);
 
-  // 5. Initialize fresh module
-  InitializeModuleAndPassManager();
-
-  // 6. Prime the first token
+  // 6. With the whole script at hand, leave out what it cannot reach of the
+  // modules it imports. Prime the first token.
+  if (!isInteractive())
+    findDeadDefinitions();
   getNextToken();
 
   // 7. Run the interpreter loop
   MainLoop();
 
   // 8. Cleanup - must reset JIT before static globals are destroyed
+  stopWatching();
   TheModule.reset();
   TheContext.reset();
   TheJIT.reset();
 
-  if (InputFile != stdin)
-    fclose(InputFile);
-
   return 0;
 }
\ No newline at end of file